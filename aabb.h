@@ -0,0 +1,55 @@
+#ifndef AABBH
+#define AABBH
+
+#include <float.h>
+#include "ray.h"
+
+__host__ __device__ inline float ffmin(float a, float b) { return a < b ? a : b; }
+__host__ __device__ inline float ffmax(float a, float b) { return a > b ? a : b; }
+
+class aabb {
+    public:
+        __host__ __device__ aabb() {}
+        __host__ __device__ aabb(const vec3& a, const vec3& b) { _min = a; _max = b; }
+        __host__ __device__ vec3 min() const { return _min; }
+        __host__ __device__ vec3 max() const { return _max; }
+        __host__ __device__ vec3 center() const { return 0.5f*(_min + _max); }
+        __host__ __device__ float area() const {
+            vec3 d = _max - _min;
+            return 2.0f*(d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+        }
+        // slab test against a ray given by its origin and the reciprocal of
+        // its direction; on a hit tnear is the entry distance
+        __device__ inline bool hit(const vec3& org, const vec3& inv_dir, float tmin, float tmax, float& tnear) const {
+            for (int a = 0; a < 3; a++) {
+                float t0 = (_min[a] - org[a]) * inv_dir[a];
+                float t1 = (_max[a] - org[a]) * inv_dir[a];
+                if (inv_dir[a] < 0.0f) { float tmp = t0; t0 = t1; t1 = tmp; }
+                tmin = ffmax(t0, tmin);
+                tmax = ffmin(t1, tmax);
+                if (tmax < tmin)
+                    return false;
+            }
+            tnear = tmin;
+            return true;
+        }
+
+        vec3 _min;
+        vec3 _max;
+};
+
+__host__ __device__ inline aabb empty_box() {
+    return aabb(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+}
+
+__host__ __device__ inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+    vec3 small(ffmin(box0.min().x(), box1.min().x()),
+               ffmin(box0.min().y(), box1.min().y()),
+               ffmin(box0.min().z(), box1.min().z()));
+    vec3 big  (ffmax(box0.max().x(), box1.max().x()),
+               ffmax(box0.max().y(), box1.max().y()),
+               ffmax(box0.max().z(), box1.max().z()));
+    return aabb(small, big);
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef ANIMATIONH
+#define ANIMATIONH
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "check_cuda.h"
+#include "config.h"
+#include "framebuffer.h"
+#include "perf_counters.h"
+#include "trace.h"
+
+// A camera path is a list of keyframes, one per line of its file:
+//   frame lookfrom lookat
+// e.g. "0 13,2,3 0,0,0".  Frames in between interpolate both points
+// linearly, frames outside the keys hold the first or last one.  The other
+// camera fields come from the scene's camera.
+struct camera_key {
+    float frame;
+    vec3 lookfrom, lookat;
+};
+
+inline bool camera_path_load(const char *path, std::vector<camera_key>& keys) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "could not open " << path << "\n";
+        return false;
+    }
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+        std::istringstream fields(line);
+        std::string from, at;
+        camera_key key;
+        if (!(fields >> key.frame >> from >> at) || !parse_vec3(from, key.lookfrom) || !parse_vec3(at, key.lookat)
+            || (!keys.empty() && key.frame <= keys.back().frame)) {
+            std::cerr << path << ":" << n << ": bad keyframe '" << line << "'\n";
+            return false;
+        }
+        keys.push_back(key);
+    }
+    if (keys.empty())
+        std::cerr << path << ": no keyframes\n";
+    return !keys.empty();
+}
+
+inline camera_params camera_path_at(const std::vector<camera_key>& keys, float frame, camera_params cam) {
+    size_t k = 0;
+    while (k+1 < keys.size() && keys[k+1].frame <= frame)
+        k++;
+    float t = 0.0f;
+    if (k+1 < keys.size() && frame > keys[k].frame)
+        t = (frame - keys[k].frame) / (keys[k+1].frame - keys[k].frame);
+    const camera_key& a = keys[k];
+    const camera_key& b = keys[k+1 < keys.size() ? k+1 : k];
+    cam.lookfrom = (1.0f-t)*a.lookfrom + t*b.lookfrom;
+    cam.lookat = (1.0f-t)*a.lookat + t*b.lookat;
+    return cam;
+}
+
+// n cameras evenly spaced on the circle of cam's lookfrom around the
+// vertical axis through lookat, starting at cam itself
+inline std::vector<camera_params> orbit_views(const camera_params& cam, int n) {
+    std::vector<camera_params> views(n, cam);
+    vec3 offset = cam.lookfrom - cam.lookat;
+    for (int k = 1; k < n; k++) {
+        float angle = 2.0f*float(M_PI)*k/n;
+        float c = cos(angle), s = sin(angle);
+        views[k].lookfrom = cam.lookat + vec3(c*offset.x() + s*offset.z(), offset.y(), -s*offset.x() + c*offset.z());
+    }
+    return views;
+}
+
+// comment, if any, goes into the header.  With a step > 1 only every
+// step'th pixel in x and y is read, and fills its step x step block.
+inline void write_ppm(std::ostream& out, const framebuffer& fb, int nx, int ny, const std::string& comment = "",
+                      int step = 1) {
+    out << "P3\n";
+    if (!comment.empty())
+        out << "# " << comment << "\n";
+    out << nx << " " << ny << "\n255\n";
+    for (int j = ny-1; j >= 0; j--) {
+        for (int i = 0; i < nx; i++) {
+            vec3 col = fb_load(fb, (j - j%step)*nx + i - i%step);
+            out << int(255.99*col.r()) << " " << int(255.99*col.g()) << " " << int(255.99*col.b()) << "\n";
+        }
+    }
+}
+
+// Encodes and writes frames on a background thread, so the render of frame
+// N+1 overlaps the output of frame N.  The frame is copied into one of two
+// pinned host buffers; the copy only waits when both are still being
+// written.
+#define FRAME_WRITER_SLOTS 2
+
+struct frame_writer {
+    int nx, ny;
+    framebuffer slots[FRAME_WRITER_SLOTS];
+    std::deque<int> free_slots;
+    struct job { int slot; std::string path; int step; };
+    std::deque<job> pending;
+    bool done;
+    double write_seconds;   // time spent encoding and writing, on the writer thread
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread thread;
+};
+
+inline void frame_writer_run(frame_writer *w) {
+    perf_counters perf;
+    int frames = 0;
+    if (perf_enabled()) perf_open(perf);
+    std::unique_lock<std::mutex> guard(w->lock);
+    for (;;) {
+        w->changed.wait(guard, [w]() { return w->done || !w->pending.empty(); });
+        if (w->pending.empty()) {
+            if (perf_enabled() && frames)
+                perf_report(std::cerr, perf, "frame writer", double(frames)*w->nx*w->ny, "pixel");
+            if (perf_enabled()) perf_close(perf);
+            return;
+        }
+        frame_writer::job job = w->pending.front();
+        w->pending.pop_front();
+        guard.unlock();
+        auto start = std::chrono::steady_clock::now();
+        int phase = trace_begin("write frame");
+        if (perf_enabled()) perf_start(perf);
+        std::ofstream out(job.path.c_str());
+        write_ppm(out, w->slots[job.slot], w->nx, w->ny, "", job.step);
+        if (!out)
+            std::cerr << "could not write " << job.path << "\n";
+        if (perf_enabled()) perf_stop(perf);
+        frames++;
+        trace_end(phase);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        guard.lock();
+        w->write_seconds += seconds;
+        w->free_slots.push_back(job.slot);
+        w->changed.notify_all();
+    }
+}
+
+inline void frame_writer_start(frame_writer& w, int format, int nx, int ny) {
+    w.nx = nx;
+    w.ny = ny;
+    for (int s = 0; s < FRAME_WRITER_SLOTS; s++) {
+        w.slots[s].format = format;
+        w.slots[s].num_pixels = nx*ny;
+        w.slots[s].accum = NULL;
+        checkCudaErrors(cudaMallocHost(&w.slots[s].data, nx*ny*fb_pixel_bytes(format)));
+        mem_alloc(MEM_PINNED, nx*ny*fb_pixel_bytes(format));
+        w.free_slots.push_back(s);
+    }
+    w.done = false;
+    w.write_seconds = 0.0;
+    w.thread = std::thread(frame_writer_run, &w);
+}
+
+// copies the rendered frame out of fb and queues it to be written to path,
+// step as for write_ppm
+inline void frame_writer_submit(frame_writer& w, const framebuffer& fb, const std::string& path, int step = 1) {
+    int s;
+    {
+        std::unique_lock<std::mutex> guard(w.lock);
+        w.changed.wait(guard, [&w]() { return !w.free_slots.empty(); });
+        s = w.free_slots.front();
+        w.free_slots.pop_front();
+    }
+    checkCudaErrors(cudaMemcpy(w.slots[s].data, fb.data, fb.num_pixels*fb_pixel_bytes(fb.format), cudaMemcpyDefault));
+    std::lock_guard<std::mutex> guard(w.lock);
+    frame_writer::job job = { s, path, step };
+    w.pending.push_back(job);
+    w.changed.notify_all();
+}
+
+// writes the remaining frames and stops the thread
+inline void frame_writer_finish(frame_writer& w) {
+    {
+        std::lock_guard<std::mutex> guard(w.lock);
+        w.done = true;
+        w.changed.notify_all();
+    }
+    w.thread.join();
+    for (int s = 0; s < FRAME_WRITER_SLOTS; s++) {
+        checkCudaErrors(cudaFreeHost(w.slots[s].data));
+        mem_release(MEM_PINNED, w.nx*w.ny*fb_pixel_bytes(w.slots[s].format));
+    }
+}
+
+#endif
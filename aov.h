@@ -0,0 +1,137 @@
+#ifndef AOVH
+#define AOVH
+
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <algorithm>
+#include <vector>
+#include "hitable.h"
+#include "material.h"
+
+// Arbitrary output variables captured from the first hit of every camera
+// ray.  Each buffer is planar: channel c of pixel p lives at
+// buf[c*num_pixels + p].  A NULL albedo pointer means AOVs are disabled.
+// Color, albedo and normal are averaged over the samples of a pixel, depth
+// and the ids come from the first sample since they can't be meaningfully
+// averaged.
+#define AOV_PLANES 12
+
+struct aov_buffers {
+    float *color;    // 3 planes: linear r, g, b, before gamma and quantization
+    float *albedo;   // 3 planes: r, g, b
+    float *normal;   // 3 planes: x, y, z
+    float *depth;    // hit distance along the (unnormalized) camera ray, FLT_MAX on miss
+    float *prim_id;  // sphere index, -1 on miss
+    float *mat_id;   // material_kind, -1 on miss
+};
+
+__device__ inline void aov_accumulate(const hit_record *first, bool hit, int s, int ns,
+                                      aov_buffers aov, int pixel_index, int num_pixels) {
+    vec3 albedo(0,0,0), normal(0,0,0);
+    if (hit) {
+        albedo = first->mat_ptr->aov_albedo();
+        normal = first->normal;
+    }
+    for (int c = 0; c < 3; c++) {
+        float *a = &aov.albedo[c*num_pixels + pixel_index];
+        float *n = &aov.normal[c*num_pixels + pixel_index];
+        if (s == 0) { *a = 0; *n = 0; }
+        *a += albedo[c] / float(ns);
+        *n += normal[c] / float(ns);
+    }
+    if (s == 0) {
+        aov.depth[pixel_index]   = hit ? first->t : FLT_MAX;
+        aov.prim_id[pixel_index] = hit ? float(first->prim_id) : -1.0f;
+        aov.mat_id[pixel_index]  = hit ? float(first->mat_ptr->kind) : -1.0f;
+    }
+}
+
+// the mean of the pixel's ns samples, as it is before fb_add_samples
+// gamma corrects and stores it in the framebuffer's format
+__device__ inline void aov_store_color(vec3 sum, int ns, aov_buffers aov, int pixel_index, int num_pixels) {
+    for (int c = 0; c < 3; c++)
+        aov.color[c*num_pixels + pixel_index] = sum[c] / float(ns);
+}
+
+static void exr_attr(std::vector<unsigned char>& out, const char *name, const char *type,
+                     const void *data, int size) {
+    out.insert(out.end(), name, name + strlen(name) + 1);
+    out.insert(out.end(), type, type + strlen(type) + 1);
+    out.insert(out.end(), (const unsigned char *)&size, (const unsigned char *)&size + 4);
+    out.insert(out.end(), (const unsigned char *)data, (const unsigned char *)data + size);
+}
+
+// Writes the beauty pass and all AOVs as one uncompressed, scanline OpenEXR
+// file with FLOAT channels.  R, G and B are the linear color, not the gamma
+// corrected framebuffer.  Buffers must be host accessible (managed memory).
+bool write_aov_exr(const char *filename, const aov_buffers& aov, int nx, int ny) {
+    int num_pixels = nx*ny;
+    struct exr_channel { const char *name; const float *plane; };
+    std::vector<exr_channel> channels = {
+        { "R", aov.color },
+        { "G", aov.color + num_pixels },
+        { "B", aov.color + 2*num_pixels },
+        { "albedo.R", aov.albedo },
+        { "albedo.G", aov.albedo + num_pixels },
+        { "albedo.B", aov.albedo + 2*num_pixels },
+        { "N.X", aov.normal },
+        { "N.Y", aov.normal + num_pixels },
+        { "N.Z", aov.normal + 2*num_pixels },
+        { "Z", aov.depth },
+        { "id.primitive", aov.prim_id },
+        { "id.material", aov.mat_id },
+    };
+    // EXR requires channels in alphabetical order, both in the header and in the pixel data
+    std::sort(channels.begin(), channels.end(),
+              [](const exr_channel& a, const exr_channel& b) { return strcmp(a.name, b.name) < 0; });
+
+    std::vector<unsigned char> hdr = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+    std::vector<unsigned char> chlist;
+    for (const exr_channel& c : channels) {
+        int desc[4] = { 2 /* FLOAT */, 0 /* pLinear + reserved */, 1, 1 };
+        chlist.insert(chlist.end(), c.name, c.name + strlen(c.name) + 1);
+        chlist.insert(chlist.end(), (unsigned char *)desc, (unsigned char *)desc + sizeof(desc));
+    }
+    chlist.push_back(0);
+    int window[4] = { 0, 0, nx-1, ny-1 };
+    unsigned char zero = 0;
+    float one = 1.0f;
+    float center[2] = { 0.0f, 0.0f };
+    exr_attr(hdr, "channels", "chlist", chlist.data(), int(chlist.size()));
+    exr_attr(hdr, "compression", "compression", &zero, 1);
+    exr_attr(hdr, "dataWindow", "box2i", window, sizeof(window));
+    exr_attr(hdr, "displayWindow", "box2i", window, sizeof(window));
+    exr_attr(hdr, "lineOrder", "lineOrder", &zero, 1);
+    exr_attr(hdr, "pixelAspectRatio", "float", &one, sizeof(one));
+    exr_attr(hdr, "screenWindowCenter", "v2f", center, sizeof(center));
+    exr_attr(hdr, "screenWindowWidth", "float", &one, sizeof(one));
+    hdr.push_back(0);
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) return false;
+    fwrite(hdr.data(), 1, hdr.size(), f);
+
+    // one scanline per chunk: int y, int size, then each channel's row
+    int line_bytes = int(channels.size()) * nx * int(sizeof(float));
+    unsigned long long offset = hdr.size() + (unsigned long long)ny * 8;
+    for (int y = 0; y < ny; y++) {
+        fwrite(&offset, 8, 1, f);
+        offset += 8 + line_bytes;
+    }
+    std::vector<float> row(nx);
+    for (int y = 0; y < ny; y++) {
+        // EXR scanlines go top to bottom, our framebuffer bottom to top
+        int j = ny-1-y;
+        fwrite(&y, 4, 1, f);
+        fwrite(&line_bytes, 4, 1, f);
+        for (const exr_channel& c : channels) {
+            for (int i = 0; i < nx; i++)
+                row[i] = c.plane[j*nx + i];
+            fwrite(row.data(), sizeof(float), nx, f);
+        }
+    }
+    return fclose(f) == 0;
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef AUTOTUNEH
+#define AUTOTUNEH
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "check_cuda.h"
+#include "tile_order.h"
+
+// How render() is launched.  SCHEDULE_STATIC launches one block per tile
+// and leaves the order to the hardware.  SCHEDULE_PERSISTENT launches
+// blocks_per_sm blocks per multiprocessor that keep taking the next tile
+// from a global counter, which balances tiles of very different cost.
+enum render_schedule { SCHEDULE_STATIC, SCHEDULE_PERSISTENT };
+
+// a tile is one block, which has at most 1024 threads, and no GPU keeps
+// more blocks resident on a multiprocessor
+#define RENDER_MAX_TILE_PIXELS 1024
+#define RENDER_MAX_BLOCKS_PER_SM 32
+
+struct render_params {
+    int tx, ty;
+    int tile_order, in_tile_order;
+    int schedule;
+    int blocks_per_sm;
+};
+
+inline render_params default_render_params() {
+    render_params p = { 8, 8, ORDER_ROW, ORDER_ROW, SCHEDULE_STATIC, 1 };
+    return p;
+}
+
+inline const char *render_schedule_name(int schedule) {
+    return schedule == SCHEDULE_PERSISTENT ? "persistent" : "static";
+}
+
+// the checks main applies to the launch options, for parameters from elsewhere
+inline bool render_params_valid(const render_params& p) {
+    return p.tx >= 1 && p.ty >= 1 && p.tx <= RENDER_MAX_TILE_PIXELS && p.ty <= RENDER_MAX_TILE_PIXELS &&
+           p.tx*p.ty <= RENDER_MAX_TILE_PIXELS &&
+           p.tile_order >= ORDER_ROW && p.tile_order <= ORDER_HILBERT &&
+           p.in_tile_order >= ORDER_ROW && p.in_tile_order <= ORDER_HILBERT &&
+           (p.schedule == SCHEDULE_STATIC || p.schedule == SCHEDULE_PERSISTENT) &&
+           p.blocks_per_sm >= 1 && p.blocks_per_sm <= RENDER_MAX_BLOCKS_PER_SM;
+}
+
+// -1 for an unknown name
+inline int parse_schedule(const char *name) {
+    if (!strcmp(name, "static")) return SCHEDULE_STATIC;
+    if (!strcmp(name, "persistent")) return SCHEDULE_PERSISTENT;
+    return -1;
+}
+
+// Tuned parameters are cached in a text file, one line per device and
+// scene class: the key, a tab, then the fields of render_params.
+#define AUTOTUNE_CACHE "autotune.cache"
+
+inline std::string autotune_key(const std::string& scene_class) {
+    int device;
+    cudaDeviceProp prop;
+    checkCudaErrors(cudaGetDevice(&device));
+    checkCudaErrors(cudaGetDeviceProperties(&prop, device));
+    std::ostringstream key;
+    key << prop.name << "/" << prop.multiProcessorCount << "sm/" << scene_class;
+    return key.str();
+}
+
+// entries that are malformed or out of range, say from a hand edited
+// cache, are skipped
+inline bool autotune_load(const char *path, const std::string& key, render_params& p) {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos || line.compare(0, tab, key) != 0)
+            continue;
+        std::istringstream fields(line.substr(tab+1));
+        render_params q;
+        if (fields >> q.tx >> q.ty >> q.tile_order >> q.in_tile_order >> q.schedule >> q.blocks_per_sm &&
+            render_params_valid(q)) {
+            p = q;
+            return true;
+        }
+    }
+    return false;
+}
+
+// replaces the entry for key, keeping the others
+inline bool autotune_store(const char *path, const std::string& key, const render_params& p) {
+    std::ostringstream kept;
+    {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line))
+            if (line.compare(0, line.find('\t'), key) != 0)
+                kept << line << "\n";
+    }
+    std::ofstream out(path);
+    out << kept.str() << key << "\t" << p.tx << " " << p.ty << " " << p.tile_order << " " << p.in_tile_order
+        << " " << p.schedule << " " << p.blocks_per_sm << "\n";
+    return bool(out);
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef BVHH
+#define BVHH
+
+#include "hitable.h"
+
+// Flat binary BVH in the layout produced by the LBVH builder: for n
+// primitives the n-1 internal nodes come first (the root is node 0) and are
+// followed by the n leaves.  A leaf's left field is the index of its
+// primitive in the hitable list, so the list itself never gets reordered.
+struct bvh_node {
+    aabb box;
+    int left;    // internal: child node, leaf: primitive index
+    int right;   // internal: child node, leaf: -1
+    int parent;  // -1 for the root
+};
+
+__host__ __device__ inline bool bvh_is_leaf(int node, int num_prims) {
+    return node >= num_prims-1;
+}
+
+// Deep enough for a Karras tree over 63-bit Morton codes plus the index
+// bits used to break ties between equal codes.
+#define BVH_STACK_SIZE 96
+
+class bvh: public hitable  {
+    public:
+        __device__ bvh() {}
+        __device__ bvh(const bvh_node *n, hitable **l, int count) : nodes(n), list(l), num_prims(count) {}
+        __device__ virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        __device__ virtual bool bounding_box(aabb& box) const { box = nodes[0].box; return true; }
+        const bvh_node *nodes;
+        hitable **list;
+        int num_prims;
+};
+
+// Stack traversal shared by every binary BVH.  leaf_hit(prim, t_min,
+// closest_so_far, rec) intersects one primitive and returns true on a hit.
+template <typename leaf_hit_t>
+__device__ inline bool bvh_traverse(const bvh_node *nodes, int num_prims, const ray& r, float t_min, float t_max,
+                                    hit_record& rec, const leaf_hit_t& leaf_hit) {
+    vec3 org = r.origin();
+    vec3 dir = r.direction();
+    vec3 inv_dir(1.0f/dir.x(), 1.0f/dir.y(), 1.0f/dir.z());
+    float tnear;
+    if (!nodes[0].box.hit(org, inv_dir, t_min, t_max, tnear))
+        return false;
+
+    // nodes are box tested before they are pushed, the stack keeps the
+    // entry distance so subtrees behind the closest hit can be skipped
+    int stack_node[BVH_STACK_SIZE];
+    float stack_t[BVH_STACK_SIZE];
+    int sp = 0;
+    stack_node[sp] = 0;
+    stack_t[sp++] = tnear;
+
+    hit_record temp_rec;
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    while (sp > 0) {
+        sp--;
+        if (stack_t[sp] > closest_so_far)
+            continue;
+        const bvh_node& node = nodes[stack_node[sp]];
+        if (bvh_is_leaf(stack_node[sp], num_prims)) {
+            if (leaf_hit(node.left, t_min, closest_so_far, temp_rec)) {
+                hit_anything = true;
+                closest_so_far = temp_rec.t;
+                rec = temp_rec;
+            }
+            continue;
+        }
+        float t_left, t_right;
+        bool hit_left = nodes[node.left].box.hit(org, inv_dir, t_min, closest_so_far, t_left);
+        bool hit_right = nodes[node.right].box.hit(org, inv_dir, t_min, closest_so_far, t_right);
+        // push the far child first so the near one is visited next
+        if (hit_left && hit_right && t_left < t_right) {
+            stack_node[sp] = node.right; stack_t[sp++] = t_right;
+            stack_node[sp] = node.left;  stack_t[sp++] = t_left;
+        }
+        else {
+            if (hit_left)  { stack_node[sp] = node.left;  stack_t[sp++] = t_left; }
+            if (hit_right) { stack_node[sp] = node.right; stack_t[sp++] = t_right; }
+        }
+    }
+    return hit_anything;
+}
+
+struct bvh_list_leaf {
+    hitable **list;
+    const ray& r;
+    __device__ bool operator()(int prim, float t_min, float t_max, hit_record& rec) const {
+        return list[prim]->hit(r, t_min, t_max, rec);
+    }
+};
+
+__device__ bool bvh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bvh_list_leaf leaf = { list, r };
+    return bvh_traverse(nodes, num_prims, r, t_min, t_max, rec, leaf);
+}
+
+__global__ void create_bvh(hitable **d_bvh, const bvh_node *nodes, hitable **list, int num_prims) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        *d_bvh = new bvh(nodes, list, num_prims);
+    }
+}
+
+__global__ void free_bvh(hitable **d_bvh) {
+    delete *d_bvh;
+}
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef BVH4H
+#define BVH4H
+
+#include <limits.h>
+#include <vector>
+#include <algorithm>
+#include "check_cuda.h"
+#include "lbvh.h"
+
+// 4-wide BVH collapsed from the binary LBVH.  Child bounds are stored as
+// structure of arrays so one node visit tests all four children with the
+// same unrolled instruction sequence, and the children that were hit are
+// visited nearest first.  Subtrees of at most four primitives become leaf
+// blocks that keep the spheres' centers and radii in the same SoA form, so
+// a leaf is tested as one batch and only the closest sphere is then
+// intersected through its hitable to fill in the hit record.
+
+#define BVH4_WIDTH 4
+#define BVH4_STACK_SIZE 128
+#define BVH4_EMPTY INT_MIN
+
+struct bvh4_node {
+    float lo_x[BVH4_WIDTH], lo_y[BVH4_WIDTH], lo_z[BVH4_WIDTH];
+    float hi_x[BVH4_WIDTH], hi_y[BVH4_WIDTH], hi_z[BVH4_WIDTH];
+    int child[BVH4_WIDTH];   // >= 0 inner node, < 0 leaf block ~child, BVH4_EMPTY for unused slots
+};
+
+struct bvh4_leaf {
+    float cx[BVH4_WIDTH], cy[BVH4_WIDTH], cz[BVH4_WIDTH];
+    float r[BVH4_WIDTH];     // < 0 for primitives that aren't spheres
+    int prim[BVH4_WIDTH];    // index in the hitable list, -1 for empty slots
+};
+
+class bvh4: public hitable  {
+    public:
+        __device__ bvh4() {}
+        __device__ bvh4(const bvh4_node *n, const bvh4_leaf *lf, hitable **l) : nodes(n), leaves(lf), list(l) {}
+        __device__ virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        __device__ virtual bool bounding_box(aabb& box) const {
+            box = empty_box();
+            for (int c = 0; c < BVH4_WIDTH; c++)
+                if (nodes[0].child[c] != BVH4_EMPTY)
+                    box = surrounding_box(box, aabb(vec3(nodes[0].lo_x[c], nodes[0].lo_y[c], nodes[0].lo_z[c]),
+                                                    vec3(nodes[0].hi_x[c], nodes[0].hi_y[c], nodes[0].hi_z[c])));
+            return true;
+        }
+        const bvh4_node *nodes;
+        const bvh4_leaf *leaves;
+        hitable **list;
+};
+
+__device__ inline bool bvh4_hit_leaf(const bvh4_leaf& leaf, hitable **list, const ray& r, float t_min, float& closest_so_far, hit_record& rec) {
+    vec3 org = r.origin();
+    vec3 dir = r.direction();
+    float a = dot(dir, dir);
+    bool hit_anything = false;
+    int best = -1;
+    int spheres = 0;
+    float best_t = closest_so_far;
+    #pragma unroll
+    for (int c = 0; c < BVH4_WIDTH; c++) {
+        if (leaf.r[c] < 0.0f) continue;
+        spheres++;
+        // same quadratic as sphere::hit
+        float ocx = org.x() - leaf.cx[c];
+        float ocy = org.y() - leaf.cy[c];
+        float ocz = org.z() - leaf.cz[c];
+        float b = ocx*dir.x() + ocy*dir.y() + ocz*dir.z();
+        float cc = ocx*ocx + ocy*ocy + ocz*ocz - leaf.r[c]*leaf.r[c];
+        float discriminant = b*b - a*cc;
+        if (discriminant > 0) {
+            float sq = sqrt(discriminant);
+            float t = (-b - sq)/a;
+            if (!(t < best_t && t > t_min)) t = (-b + sq)/a;
+            if (t < best_t && t > t_min) { best_t = t; best = c; }
+        }
+    }
+    // the closest sphere's hit() counts its own test
+    count_primitive_tests(r, best >= 0 ? spheres - 1 : spheres);
+    hit_record temp_rec;
+    if (best >= 0 && list[leaf.prim[best]]->hit(r, t_min, closest_so_far, temp_rec)) {
+        hit_anything = true;
+        closest_so_far = temp_rec.t;
+        rec = temp_rec;
+    }
+    // anything that isn't a sphere goes through its own hit()
+    for (int c = 0; c < BVH4_WIDTH; c++) {
+        if (leaf.prim[c] < 0 || leaf.r[c] >= 0.0f) continue;
+        if (list[leaf.prim[c]]->hit(r, t_min, closest_so_far, temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+        }
+    }
+    return hit_anything;
+}
+
+// pushes the children that were hit, farthest first so the nearest is popped
+// next.  bvh4_collapse refuses trees the stack is too small for.
+__device__ inline void bvh4_push_ordered(const int *child, const float *tnear, const bool *hit_child,
+                                         int *stack_node, float *stack_t, int& sp) {
+    int order[BVH4_WIDTH];
+    int num_hit = 0;
+    for (int c = 0; c < BVH4_WIDTH; c++) {
+        if (!hit_child[c]) continue;
+        int k = num_hit++;
+        while (k > 0 && tnear[order[k-1]] < tnear[c]) {
+            order[k] = order[k-1];
+            k--;
+        }
+        order[k] = c;
+    }
+    for (int k = 0; k < num_hit; k++) {
+        stack_node[sp] = child[order[k]];
+        stack_t[sp++] = tnear[order[k]];
+    }
+}
+
+__device__ bool bvh4::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    vec3 org = r.origin();
+    vec3 dir = r.direction();
+    vec3 inv_dir(1.0f/dir.x(), 1.0f/dir.y(), 1.0f/dir.z());
+
+    int stack_node[BVH4_STACK_SIZE];
+    float stack_t[BVH4_STACK_SIZE];
+    int sp = 0;
+    stack_node[sp] = 0;
+    stack_t[sp++] = t_min;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    while (sp > 0) {
+        sp--;
+        if (stack_t[sp] > closest_so_far)
+            continue;
+        int idx = stack_node[sp];
+        if (idx < 0) {
+            if (bvh4_hit_leaf(leaves[~idx], list, r, t_min, closest_so_far, rec))
+                hit_anything = true;
+            continue;
+        }
+
+        // all four slab tests at once
+        const bvh4_node& node = nodes[idx];
+        float tnear[BVH4_WIDTH];
+        bool hit_child[BVH4_WIDTH];
+        #pragma unroll
+        for (int c = 0; c < BVH4_WIDTH; c++) {
+            float t0x = (node.lo_x[c] - org.x()) * inv_dir.x();
+            float t1x = (node.hi_x[c] - org.x()) * inv_dir.x();
+            float t0y = (node.lo_y[c] - org.y()) * inv_dir.y();
+            float t1y = (node.hi_y[c] - org.y()) * inv_dir.y();
+            float t0z = (node.lo_z[c] - org.z()) * inv_dir.z();
+            float t1z = (node.hi_z[c] - org.z()) * inv_dir.z();
+            float tmin = ffmax(ffmax(ffmin(t0x, t1x), ffmin(t0y, t1y)), ffmax(ffmin(t0z, t1z), t_min));
+            float tmax = ffmin(ffmin(ffmax(t0x, t1x), ffmax(t0y, t1y)), ffmin(ffmax(t0z, t1z), closest_so_far));
+            tnear[c] = tmin;
+            hit_child[c] = tmin <= tmax && node.child[c] != BVH4_EMPTY;
+        }
+
+        bvh4_push_ordered(node.child, tnear, hit_child, stack_node, stack_t, sp);
+    }
+    return hit_anything;
+}
+
+__global__ void bvh4_gather_spheres(hitable **list, int n, float4 *spheres) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= n) return;
+    vec3 center(0,0,0);
+    float radius = -1.0f;
+    if (!list[i]->bounding_sphere(center, radius))
+        radius = -1.0f;
+    spheres[i] = make_float4(center.x(), center.y(), center.z(), radius);
+}
+
+__global__ void create_bvh4(hitable **d_bvh, const bvh4_node *nodes, const bvh4_leaf *leaves, hitable **list) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        *d_bvh = new bvh4(nodes, leaves, list);
+    }
+}
+
+struct bvh4_accel {
+    bvh4_node *nodes;
+    bvh4_leaf *leaves;
+    int num_nodes;
+    int num_leaves;
+};
+
+// host side collapse of the binary tree
+struct bvh4_collapser {
+    const std::vector<bvh_node>& bin;
+    const std::vector<float4>& spheres;
+    int num_prims;
+    std::vector<int> prim_count;
+    std::vector<bvh4_node> nodes;
+    std::vector<bvh4_leaf> leaves;
+
+    bvh4_collapser(const std::vector<bvh_node>& b, const std::vector<float4>& s, int n)
+        : bin(b), spheres(s), num_prims(n), prim_count(2*n-1, 0) {
+        count(0);
+    }
+
+    int count(int node) {
+        if (bvh_is_leaf(node, num_prims)) return prim_count[node] = 1;
+        return prim_count[node] = count(bin[node].left) + count(bin[node].right);
+    }
+
+    void gather_prims(int node, bvh4_leaf& leaf, int& k) {
+        if (bvh_is_leaf(node, num_prims)) {
+            int p = bin[node].left;
+            leaf.cx[k] = spheres[p].x;
+            leaf.cy[k] = spheres[p].y;
+            leaf.cz[k] = spheres[p].z;
+            leaf.r[k] = spheres[p].w;
+            leaf.prim[k++] = p;
+            return;
+        }
+        gather_prims(bin[node].left, leaf, k);
+        gather_prims(bin[node].right, leaf, k);
+    }
+
+    int make_leaf(int node) {
+        bvh4_leaf leaf;
+        int k = 0;
+        gather_prims(node, leaf, k);
+        for (; k < BVH4_WIDTH; k++) {
+            leaf.cx[k] = leaf.cy[k] = leaf.cz[k] = 0.0f;
+            leaf.r[k] = -1.0f;
+            leaf.prim[k] = -1;
+        }
+        leaves.push_back(leaf);
+        return ~int(leaves.size()-1);
+    }
+
+    // opens up the largest child until there are four of them or only
+    // leaf-sized subtrees are left
+    int collapse(int node) {
+        std::vector<int> children;
+        if (bvh_is_leaf(node, num_prims)) children.push_back(node);
+        else { children.push_back(bin[node].left); children.push_back(bin[node].right); }
+        while (children.size() < BVH4_WIDTH) {
+            int best = -1;
+            float best_area = -1.0f;
+            for (size_t c = 0; c < children.size(); c++) {
+                if (prim_count[children[c]] <= BVH4_WIDTH) continue;
+                float area = bin[children[c]].box.area();
+                if (area > best_area) { best_area = area; best = int(c); }
+            }
+            if (best < 0) break;
+            int expand = children[best];
+            children[best] = bin[expand].left;
+            children.push_back(bin[expand].right);
+        }
+
+        int idx = int(nodes.size());
+        nodes.push_back(bvh4_node());
+        for (int c = 0; c < BVH4_WIDTH; c++) {
+            aabb box = empty_box();
+            int child = BVH4_EMPTY;
+            if (c < int(children.size())) {
+                box = bin[children[c]].box;
+                child = prim_count[children[c]] <= BVH4_WIDTH ? make_leaf(children[c]) : collapse(children[c]);
+            }
+            bvh4_node& n = nodes[idx];
+            n.lo_x[c] = box.min().x(); n.lo_y[c] = box.min().y(); n.lo_z[c] = box.min().z();
+            n.hi_x[c] = box.max().x(); n.hi_y[c] = box.max().y(); n.hi_z[c] = box.max().z();
+            n.child[c] = child;
+        }
+        return idx;
+    }
+};
+
+// the most stack entries a traversal from node idx can hold: a visit pops
+// the node and pushes its children, the nearest of which is visited next
+int bvh4_stack_depth(const std::vector<bvh4_node>& nodes, int idx) {
+    int num_children = 0, deepest = 1;
+    for (int c = 0; c < BVH4_WIDTH; c++) {
+        int child = nodes[idx].child[c];
+        if (child == BVH4_EMPTY) continue;
+        num_children++;
+        if (child >= 0) deepest = std::max(deepest, bvh4_stack_depth(nodes, child));
+    }
+    return std::max(1, num_children - 1 + deepest);
+}
+
+// Collapses the binary tree on the host, leaving the result in host memory.
+// False if a traversal of the result could need more than BVH4_STACK_SIZE
+// stack entries; the caller keeps the binary tree then.
+bool bvh4_collapse(const lbvh& bin, hitable **d_list, std::vector<bvh4_node>& nodes, std::vector<bvh4_leaf>& leaves) {
+    int n = bin.num_prims;
+    std::vector<bvh_node> h_nodes(2*n-1);
+    std::vector<float4> h_spheres(n);
+    float4 *d_spheres;
+    checkCudaErrors(cudaMalloc((void **)&d_spheres, n*sizeof(float4)));
+    mem_alloc(MEM_SCRATCH, n*sizeof(float4));
+    bvh4_gather_spheres<<<(n+LBVH_BLOCK-1)/LBVH_BLOCK, LBVH_BLOCK>>>(d_list, n, d_spheres);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaMemcpy(h_spheres.data(), d_spheres, n*sizeof(float4), cudaMemcpyDeviceToHost));
+    checkCudaErrors(cudaMemcpy(h_nodes.data(), bin.nodes, (2*n-1)*sizeof(bvh_node), cudaMemcpyDeviceToHost));
+    checkCudaErrors(cudaFree(d_spheres));
+    mem_release(MEM_SCRATCH, n*sizeof(float4));
+
+    bvh4_collapser collapser(h_nodes, h_spheres, n);
+    collapser.collapse(0);
+    int depth = bvh4_stack_depth(collapser.nodes, 0);
+    if (depth > BVH4_STACK_SIZE) {
+        std::cerr << "the BVH4 may need " << depth << " stack entries, more than the " << BVH4_STACK_SIZE
+                  << " of the traversal.\n";
+        return false;
+    }
+    nodes.swap(collapser.nodes);
+    leaves.swap(collapser.leaves);
+    return true;
+}
+
+// a wide BVH over num_prims takes at most a leaf per primitive and one node
+// less, the collapse usually fills leaves to two or three primitives
+inline size_t bvh4_max_bytes(int num_prims, size_t node_bytes) {
+    return size_t(num_prims > 1 ? num_prims-1 : 1)*node_bytes + size_t(num_prims)*sizeof(bvh4_leaf);
+}
+
+// false, allocating nothing, if bvh4_collapse refuses the tree
+bool bvh4_build(bvh4_accel& accel, const lbvh& bin, hitable **d_list) {
+    std::vector<bvh4_node> nodes;
+    std::vector<bvh4_leaf> leaves;
+    if (!bvh4_collapse(bin, d_list, nodes, leaves))
+        return false;
+    accel.num_nodes = int(nodes.size());
+    accel.num_leaves = int(leaves.size());
+    checkCudaErrors(cudaMalloc((void **)&accel.nodes, accel.num_nodes*sizeof(bvh4_node)));
+    checkCudaErrors(cudaMalloc((void **)&accel.leaves, accel.num_leaves*sizeof(bvh4_leaf)));
+    checkCudaErrors(cudaMemcpy(accel.nodes, nodes.data(), accel.num_nodes*sizeof(bvh4_node), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(accel.leaves, leaves.data(), accel.num_leaves*sizeof(bvh4_leaf), cudaMemcpyHostToDevice));
+    mem_alloc(MEM_ACCEL, accel.num_nodes*sizeof(bvh4_node) + accel.num_leaves*sizeof(bvh4_leaf));
+    return true;
+}
+
+void bvh4_free(bvh4_accel& accel) {
+    checkCudaErrors(cudaFree(accel.nodes));
+    checkCudaErrors(cudaFree(accel.leaves));
+    mem_release(MEM_ACCEL, accel.num_nodes*sizeof(bvh4_node) + accel.num_leaves*sizeof(bvh4_leaf));
+}
+
+#endif
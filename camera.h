@@ -1,14 +1,14 @@
 #ifndef CAMERAH
 #define CAMERAH
 
-#include <curand_kernel.h>
 #include "ray.h"
+#include "sample_rng.h"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
-__device__ vec3 random_in_unit_disk(curandState *local_rand_state) {
+__device__ vec3 random_in_unit_disk(sample_rng *local_rand_state) {
     vec3 p;
     do {
         p = 2.0f*vec3(curand_uniform(local_rand_state),curand_uniform(local_rand_state),0) - vec3(1,1,0);
@@ -31,7 +31,7 @@ public:
         horizontal = 2.0f*half_width*focus_dist*u;
         vertical = 2.0f*half_height*focus_dist*v;
     }
-    __device__ ray get_ray(float s, float t, curandState *local_rand_state) {
+    __device__ ray get_ray(float s, float t, sample_rng *local_rand_state) {
         vec3 rd = lens_radius*random_in_unit_disk(local_rand_state);
         vec3 offset = u * rd.x() + v * rd.y();
         return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset);
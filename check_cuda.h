@@ -0,0 +1,21 @@
+#ifndef CHECKCUDAH
+#define CHECKCUDAH
+
+#include <iostream>
+#include <stdlib.h>
+#include <cuda_runtime.h>
+
+// limited version of checkCudaErrors from helper_cuda.h in CUDA examples
+#define checkCudaErrors(val) check_cuda( (val), #val, __FILE__, __LINE__ )
+
+inline void check_cuda(cudaError_t result, char const *const func, const char *const file, int const line) {
+    if (result) {
+        std::cerr << "CUDA error = " << static_cast<unsigned int>(result) << " at " <<
+            file << ":" << line << " '" << func <<" "<<cudaGetErrorString(result)<< "' \n";
+        // Make sure we call CUDA Device Reset before exiting
+        cudaDeviceReset();
+        exit(99);
+    }
+}
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef CONFIGH
+#define CONFIGH
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "vec3.h"
+
+// Camera placement as passed to camera's constructor, focus_dist 0 focuses
+// on lookat.
+struct camera_params {
+    vec3 lookfrom, lookat, vup;
+    float vfov, aperture, focus_dist;
+};
+
+enum { CAM_LOOKFROM = 1, CAM_LOOKAT = 2, CAM_VUP = 4, CAM_VFOV = 8, CAM_APERTURE = 16, CAM_FOCUS_DIST = 32 };
+
+// Everything a render used to have compiled in.  Settings are key=value
+// pairs, read from a file with -config and given one by one with -set:
+//   width, height, samples, max_depth, seed, time_budget,
+//   lookfrom, lookat, vup (as x,y,z), vfov, aperture, focus_dist
+// Camera settings override the scene's own camera field by field.  A
+// time_budget in ms renders progressively for that long instead of to a
+// number of samples.  The sizes are capped far above any sensible render,
+// low enough that pixel and sample counts stay within an int.
+#define CONFIG_MAX_SIZE 32768
+#define CONFIG_MAX_SAMPLES (1 << 20)
+#define CONFIG_MAX_DEPTH 1024
+// views rendered at once, which also have to fit an int of pixels together
+#define CONFIG_MAX_VIEWS 4096
+// a day, in ms
+#define CONFIG_MAX_TIME_BUDGET 86400000.0f
+
+struct render_config {
+    int nx, ny, ns;
+    int max_depth;
+    unsigned int seed;
+    float time_budget;  // ms, 0 for none
+    camera_params cam;
+    int cam_set;    // CAM_* bits of the fields of cam that were set
+};
+
+inline render_config default_render_config() {
+    render_config cfg;
+    cfg.nx = 1200;
+    cfg.ny = 800;
+    cfg.ns = 20;
+    cfg.max_depth = 50;
+    cfg.seed = 1984;
+    cfg.time_budget = 0.0f;
+    cfg.cam_set = 0;
+    return cfg;
+}
+
+inline bool parse_vec3(const std::string& s, vec3& v) {
+    float x, y, z;
+    if (sscanf(s.c_str(), "%f,%f,%f", &x, &y, &z) != 3)
+        return false;
+    v = vec3(x, y, z);
+    return true;
+}
+
+inline bool parse_int(const std::string& s, int& v, int min_value, int max_value = INT_MAX) {
+    char *end;
+    long x = strtol(s.c_str(), &end, 10);
+    if (end == s.c_str() || *end || x < min_value || x > max_value)
+        return false;
+    v = int(x);
+    return true;
+}
+
+inline bool parse_float(const std::string& s, float& v) {
+    char *end;
+    v = strtof(s.c_str(), &end);
+    return end != s.c_str() && !*end;
+}
+
+// applies one setting, false for unknown keys and malformed values
+inline bool config_set(render_config& cfg, const std::string& key, const std::string& value) {
+    int seed;
+    if (key == "width") return parse_int(value, cfg.nx, 1, CONFIG_MAX_SIZE);
+    if (key == "height") return parse_int(value, cfg.ny, 1, CONFIG_MAX_SIZE);
+    if (key == "samples") return parse_int(value, cfg.ns, 1, CONFIG_MAX_SAMPLES);
+    if (key == "max_depth") return parse_int(value, cfg.max_depth, 1, CONFIG_MAX_DEPTH);
+    if (key == "seed") {
+        if (!parse_int(value, seed, 0)) return false;
+        cfg.seed = seed;
+        return true;
+    }
+    if (key == "time_budget")  // the comparisons are false for nan
+        return parse_float(value, cfg.time_budget) && cfg.time_budget >= 0.0f &&
+               cfg.time_budget <= CONFIG_MAX_TIME_BUDGET;
+    bool ok;
+    int field;
+    if (key == "lookfrom") { ok = parse_vec3(value, cfg.cam.lookfrom); field = CAM_LOOKFROM; }
+    else if (key == "lookat") { ok = parse_vec3(value, cfg.cam.lookat); field = CAM_LOOKAT; }
+    else if (key == "vup") { ok = parse_vec3(value, cfg.cam.vup); field = CAM_VUP; }
+    else if (key == "vfov") { ok = parse_float(value, cfg.cam.vfov); field = CAM_VFOV; }
+    else if (key == "aperture") { ok = parse_float(value, cfg.cam.aperture); field = CAM_APERTURE; }
+    else if (key == "focus_dist") { ok = parse_float(value, cfg.cam.focus_dist); field = CAM_FOCUS_DIST; }
+    else return false;
+    if (ok) cfg.cam_set |= field;
+    return ok;
+}
+
+inline std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t\r");
+    if (b == std::string::npos) return "";
+    size_t e = s.find_last_not_of(" \t\r");
+    return s.substr(b, e-b+1);
+}
+
+// "key=value" as given to -set
+inline bool config_set(render_config& cfg, const std::string& setting) {
+    size_t eq = setting.find('=');
+    if (eq == std::string::npos)
+        return false;
+    return config_set(cfg, trim(setting.substr(0, eq)), trim(setting.substr(eq+1)));
+}
+
+// one setting per line, # starts a comment
+inline bool config_load(render_config& cfg, const char *path) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "could not open " << path << "\n";
+        return false;
+    }
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+        if (!config_set(cfg, line)) {
+            std::cerr << path << ":" << n << ": bad setting '" << line << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool is_camera_key(const std::string& key) {
+    return key == "lookfrom" || key == "lookat" || key == "vup" || key == "vfov" || key == "aperture"
+        || key == "focus_dist";
+}
+
+// One view per line, given as camera settings separated by spaces, e.g.
+//   lookfrom=13,2,3 vfov=20
+// Only the camera fields of the configs in views are set.
+inline bool config_load_views(const char *path, std::vector<render_config>& views) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "could not open " << path << "\n";
+        return false;
+    }
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+        if (views.size() >= CONFIG_MAX_VIEWS) {
+            std::cerr << path << ":" << n << ": more than " << CONFIG_MAX_VIEWS << " views\n";
+            return false;
+        }
+        render_config view = default_render_config();
+        std::istringstream settings(line);
+        std::string setting;
+        while (settings >> setting) {
+            if (!is_camera_key(setting.substr(0, setting.find('='))) || !config_set(view, setting)) {
+                std::cerr << path << ":" << n << ": bad camera setting '" << setting << "'\n";
+                return false;
+            }
+        }
+        views.push_back(view);
+    }
+    return true;
+}
+
+// settings in a canonical form, equal for equal configs
+inline std::string config_key(const render_config& cfg) {
+    std::ostringstream key;
+    key << "width=" << cfg.nx << " height=" << cfg.ny << " samples=" << cfg.ns << " max_depth=" << cfg.max_depth
+        << " seed=" << cfg.seed;
+    if (cfg.time_budget > 0.0f) key << " time_budget=" << cfg.time_budget;
+    if (cfg.cam_set & CAM_LOOKFROM) key << " lookfrom=" << cfg.cam.lookfrom;
+    if (cfg.cam_set & CAM_LOOKAT) key << " lookat=" << cfg.cam.lookat;
+    if (cfg.cam_set & CAM_VUP) key << " vup=" << cfg.cam.vup;
+    if (cfg.cam_set & CAM_VFOV) key << " vfov=" << cfg.cam.vfov;
+    if (cfg.cam_set & CAM_APERTURE) key << " aperture=" << cfg.cam.aperture;
+    if (cfg.cam_set & CAM_FOCUS_DIST) key << " focus_dist=" << cfg.cam.focus_dist;
+    return key.str();
+}
+
+// What the world is built from.  As settings:
+//   scene=book|diffuse|instanced, instances (grid size), mesh (a .ply or
+//   .obj file, renders it instead), accel=list|lbvh|bvh4|qbvh4, morton64=0|1
+// The grid is capped, its grid*grid instances are allocated up front.
+#define SCENE_MAX_INSTANCE_GRID 1024
+
+enum scene_type { SCENE_BOOK, SCENE_INSTANCED, SCENE_MESH };
+enum accel_type { ACCEL_LIST, ACCEL_LBVH, ACCEL_BVH4, ACCEL_QBVH4 };
+
+struct scene_config {
+    int type;
+    bool diffuse_only;  // the book's scene with lambertians only
+    int instance_grid;
+    std::string mesh_file;
+    int accel;
+    bool morton64;
+};
+
+inline scene_config default_scene_config() {
+    scene_config sc;
+    sc.type = SCENE_BOOK;
+    sc.diffuse_only = false;
+    sc.instance_grid = 64;
+    sc.accel = ACCEL_LBVH;
+    sc.morton64 = false;
+    return sc;
+}
+
+// -1 for an unknown name
+inline int parse_accel(const std::string& name) {
+    if (name == "list") return ACCEL_LIST;
+    if (name == "lbvh") return ACCEL_LBVH;
+    if (name == "bvh4") return ACCEL_BVH4;
+    if (name == "qbvh4") return ACCEL_QBVH4;
+    return -1;
+}
+
+inline bool scene_config_set(scene_config& sc, const std::string& key, const std::string& value) {
+    if (key == "scene") {
+        if (value != "book" && value != "diffuse" && value != "instanced") return false;
+        sc.type = value == "instanced" ? SCENE_INSTANCED : SCENE_BOOK;
+        sc.diffuse_only = value == "diffuse";
+        return true;
+    }
+    if (key == "instances") return parse_int(value, sc.instance_grid, 1, SCENE_MAX_INSTANCE_GRID);
+    if (key == "mesh") { sc.mesh_file = value; sc.type = SCENE_MESH; return !value.empty(); }
+    if (key == "accel") {
+        int accel = parse_accel(value);
+        if (accel < 0) return false;
+        sc.accel = accel;
+        return true;
+    }
+    if (key == "morton64") { sc.morton64 = value == "1"; return value == "0" || value == "1"; }
+    return false;
+}
+
+// the kind of scene, e.g. "book/lbvh", which is what launch parameters are
+// tuned for
+inline std::string scene_class(const scene_config& sc) {
+    static const char *accels[] = { "list", "lbvh", "bvh4", "qbvh4" };
+    std::string kind = sc.type == SCENE_MESH ? "mesh" : sc.type == SCENE_INSTANCED ? "instanced" :
+                       sc.diffuse_only ? "diffuse" : "book";
+    return kind + "/" + accels[sc.accel];
+}
+
+// equal for configs that build the same scene, the random scenes also
+// depend on the seed
+inline std::string scene_key(const scene_config& sc, unsigned int seed) {
+    std::ostringstream key;
+    key << scene_class(sc) << (sc.morton64 ? "/morton64" : "") << "/" << seed;
+    if (sc.type == SCENE_INSTANCED) key << "/" << sc.instance_grid;
+    if (sc.type == SCENE_MESH) key << "/" << sc.mesh_file;
+    return key.str();
+}
+
+// the scene's camera with the fields set in the config replaced
+inline camera_params config_camera(const render_config& cfg, camera_params cam) {
+    if (cfg.cam_set & CAM_LOOKFROM) cam.lookfrom = cfg.cam.lookfrom;
+    if (cfg.cam_set & CAM_LOOKAT) cam.lookat = cfg.cam.lookat;
+    if (cfg.cam_set & CAM_VUP) cam.vup = cfg.cam.vup;
+    if (cfg.cam_set & CAM_VFOV) cam.vfov = cfg.cam.vfov;
+    if (cfg.cam_set & CAM_APERTURE) cam.aperture = cfg.cam.aperture;
+    if (cfg.cam_set & CAM_FOCUS_DIST) cam.focus_dist = cfg.cam.focus_dist;
+    return cam;
+}
+
+#endif
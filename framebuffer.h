@@ -0,0 +1,168 @@
+#ifndef FRAMEBUFFERH
+#define FRAMEBUFFERH
+
+#include <math.h>
+#include <string.h>
+#include <cuda_fp16.h>
+#include "check_cuda.h"
+#include "mem_usage.h"
+#include "vec3.h"
+
+// Storage format of the final, gamma corrected image.  Rendering always
+// accumulates in float; only the stored result is narrowed:
+//   FB_FLOAT  a vec3 per pixel
+//   FB_HALF   three halves, 6 bytes
+//   FB_RGBE   Ward's shared exponent format, 4 bytes
+//   FB_RGB8   three bytes, what the PPM output keeps anyway
+enum fb_format { FB_FLOAT, FB_HALF, FB_RGBE, FB_RGB8 };
+
+// With an accumulation buffer renders are progressive: each adds its
+// samples to the running sums in accum and stores the average over all
+// accum_samples + its own samples.
+struct framebuffer {
+    int format;
+    int num_pixels;
+    void *data;     // managed, so the host reads it back directly
+    vec3 *accum;    // NULL unless progressive
+    int accum_samples;
+};
+
+__host__ __device__ inline size_t fb_pixel_bytes(int format) {
+    switch (format) {
+    case FB_HALF: return 3*sizeof(__half);
+    case FB_RGBE: return 4;
+    case FB_RGB8: return 3;
+    default:      return sizeof(vec3);
+    }
+}
+
+inline const char *fb_format_name(int format) {
+    return format == FB_HALF ? "half" : format == FB_RGBE ? "rgbe" : format == FB_RGB8 ? "rgb8" : "float";
+}
+
+// -1 for an unknown name
+inline int parse_fb_format(const char *name) {
+    if (!strcmp(name, "float")) return FB_FLOAT;
+    if (!strcmp(name, "half")) return FB_HALF;
+    if (!strcmp(name, "rgbe")) return FB_RGBE;
+    if (!strcmp(name, "rgb8")) return FB_RGB8;
+    return -1;
+}
+
+__host__ __device__ inline unsigned char fb_to_byte(float c) {
+    return (unsigned char)(255.99f*fminf(fmaxf(c, 0.0f), 1.0f));
+}
+
+__host__ __device__ inline unsigned int rgbe_encode(const vec3& c) {
+    float v = fmaxf(c.r(), fmaxf(c.g(), c.b()));
+    if (v < 1e-32f)
+        return 0;
+    int e;
+    float m = frexpf(v, &e) * 256.0f / v;
+    return (unsigned int)(c.r()*m) | (unsigned int)(c.g()*m) << 8 | (unsigned int)(c.b()*m) << 16
+         | (unsigned int)(e + 128) << 24;
+}
+
+__host__ __device__ inline vec3 rgbe_decode(unsigned int rgbe) {
+    int e = rgbe >> 24;
+    if (e == 0)
+        return vec3(0, 0, 0);
+    float f = ldexpf(1.0f, e - (128+8));
+    return vec3(((rgbe & 0xff) + 0.5f)*f, ((rgbe >> 8 & 0xff) + 0.5f)*f, ((rgbe >> 16 & 0xff) + 0.5f)*f);
+}
+
+__device__ inline void fb_store(const framebuffer& fb, int i, const vec3& c) {
+    switch (fb.format) {
+    case FB_HALF: {
+        __half *h = (__half *)fb.data + 3*size_t(i);
+        h[0] = __float2half(c.r());
+        h[1] = __float2half(c.g());
+        h[2] = __float2half(c.b());
+        break;
+    }
+    case FB_RGBE:
+        ((unsigned int *)fb.data)[i] = rgbe_encode(c);
+        break;
+    case FB_RGB8: {
+        unsigned char *p = (unsigned char *)fb.data + 3*size_t(i);
+        p[0] = fb_to_byte(c.r());
+        p[1] = fb_to_byte(c.g());
+        p[2] = fb_to_byte(c.b());
+        break;
+    }
+    default:
+        ((vec3 *)fb.data)[i] = c;
+    }
+}
+
+// stores the pixel whose ns samples add up to sum, gamma corrected
+__device__ inline void fb_add_samples(const framebuffer& fb, int i, vec3 sum, int ns) {
+    if (fb.accum) {
+        sum += fb.accum[i];
+        fb.accum[i] = sum;
+        ns += fb.accum_samples;
+    }
+    vec3 col = sum / float(ns);
+    col[0] = sqrt(col[0]);
+    col[1] = sqrt(col[1]);
+    col[2] = sqrt(col[2]);
+    fb_store(fb, i, col);
+}
+
+// host side read back, RGB8 comes back as the center of the byte's range
+inline vec3 fb_load(const framebuffer& fb, int i) {
+    switch (fb.format) {
+    case FB_HALF: {
+        const __half *h = (const __half *)fb.data + 3*size_t(i);
+        return vec3(__half2float(h[0]), __half2float(h[1]), __half2float(h[2]));
+    }
+    case FB_RGBE:
+        return rgbe_decode(((const unsigned int *)fb.data)[i]);
+    case FB_RGB8: {
+        const unsigned char *p = (const unsigned char *)fb.data + 3*size_t(i);
+        return vec3((p[0] + 0.5f)/255.99f, (p[1] + 0.5f)/255.99f, (p[2] + 0.5f)/255.99f);
+    }
+    default:
+        return ((const vec3 *)fb.data)[i];
+    }
+}
+
+// the view'th of several images of num_pixels each stored back to back
+__host__ __device__ inline framebuffer fb_view(const framebuffer& fb, int view, int num_pixels) {
+    framebuffer v = { fb.format, num_pixels, (char *)fb.data + size_t(view)*num_pixels*fb_pixel_bytes(fb.format),
+                      fb.accum ? fb.accum + size_t(view)*num_pixels : NULL, fb.accum_samples };
+    return v;
+}
+
+inline void framebuffer_alloc(framebuffer& fb, int format, int num_pixels) {
+    fb.format = format;
+    fb.num_pixels = num_pixels;
+    checkCudaErrors(cudaMallocManaged((void **)&fb.data, num_pixels*fb_pixel_bytes(format)));
+    mem_alloc(MEM_FRAMEBUFFER, num_pixels*fb_pixel_bytes(format));
+    fb.accum = NULL;
+    fb.accum_samples = 0;
+}
+
+// makes renders into fb progressive, starting from no samples
+inline void framebuffer_alloc_accum(framebuffer& fb) {
+    checkCudaErrors(cudaMalloc((void **)&fb.accum, fb.num_pixels*sizeof(vec3)));
+    mem_alloc(MEM_FRAMEBUFFER, fb.num_pixels*sizeof(vec3));
+    checkCudaErrors(cudaMemset(fb.accum, 0, fb.num_pixels*sizeof(vec3)));
+    fb.accum_samples = 0;
+}
+
+// does nothing for a framebuffer that was zero initialized or already freed
+inline void framebuffer_free(framebuffer& fb) {
+    if (!fb.data)
+        return;
+    checkCudaErrors(cudaFree(fb.data));
+    fb.data = NULL;
+    mem_release(MEM_FRAMEBUFFER, fb.num_pixels*fb_pixel_bytes(fb.format));
+    if (fb.accum) {
+        checkCudaErrors(cudaFree(fb.accum));
+        mem_release(MEM_FRAMEBUFFER, fb.num_pixels*sizeof(vec3));
+        fb.accum = NULL;
+    }
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define HITABLEH
 
 #include "ray.h"
+#include "aabb.h"
 
 class material;
 
@@ -11,11 +12,15 @@ struct hit_record
     vec3 p;
     vec3 normal;
     material *mat_ptr;
+    int prim_id;
 };
 
 class hitable  {
     public:
         __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+        __device__ virtual bool bounding_box(aabb& box) const = 0;
+        // only spheres answer this, it lets wide BVH leaves test them in batches
+        __device__ virtual bool bounding_sphere(vec3& center, float& radius) const { return false; }
 };
 
 #endif
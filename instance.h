@@ -0,0 +1,106 @@
+#ifndef INSTANCEH
+#define INSTANCEH
+
+#include "hitable.h"
+
+// affine object-to-world transform, row major 3x4
+struct transform {
+    float m[3][4];
+
+    __host__ __device__ inline vec3 point(const vec3& p) const {
+        return vec3(m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+                    m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+                    m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]);
+    }
+    __host__ __device__ inline vec3 vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+                    m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+                    m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+    }
+    // multiplies by the transposed linear part, used with the inverse
+    // transform to carry normals from object to world space
+    __host__ __device__ inline vec3 vector_transposed(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+                    m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+                    m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z());
+    }
+};
+
+// uniform scale, then rotation about y, then translation
+__host__ __device__ inline transform make_transform(float scale, float angle_y, const vec3& offset) {
+    float c = cos(angle_y), s = sin(angle_y);
+    transform t = {{ {  c*scale, 0.0f,  s*scale, offset.x() },
+                     {  0.0f,    scale, 0.0f,    offset.y() },
+                     { -s*scale, 0.0f,  c*scale, offset.z() } }};
+    return t;
+}
+
+__host__ __device__ inline transform inverse(const transform& t) {
+    const float (*m)[4] = t.m;
+    float det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+              - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+              + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    float k = 1.0f / det;
+    transform inv;
+    inv.m[0][0] =  (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * k;
+    inv.m[0][1] = -(m[0][1]*m[2][2] - m[0][2]*m[2][1]) * k;
+    inv.m[0][2] =  (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * k;
+    inv.m[1][0] = -(m[1][0]*m[2][2] - m[1][2]*m[2][0]) * k;
+    inv.m[1][1] =  (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * k;
+    inv.m[1][2] = -(m[0][0]*m[1][2] - m[0][2]*m[1][0]) * k;
+    inv.m[2][0] =  (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * k;
+    inv.m[2][1] = -(m[0][0]*m[2][1] - m[0][1]*m[2][0]) * k;
+    inv.m[2][2] =  (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * k;
+    vec3 offset = -inv.vector(vec3(m[0][3], m[1][3], m[2][3]));
+    inv.m[0][3] = offset.x();
+    inv.m[1][3] = offset.y();
+    inv.m[2][3] = offset.z();
+    return inv;
+}
+
+// A placed copy of shared geometry.  Rays are moved into object space
+// (without renormalizing the direction, so t means the same in both
+// spaces), intersected with the shared bottom-level structure, and the hit
+// is moved back.  Only the two transforms are stored per instance, so a
+// scene's memory grows with its unique geometry, not with its copies.
+class instance: public hitable  {
+    public:
+        __device__ instance() {}
+        __device__ instance(hitable *obj, const transform& xf)
+            : object(obj), to_world(xf), to_object(inverse(xf)) {}
+        __device__ virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        __device__ virtual bool bounding_box(aabb& box) const;
+        hitable *object;
+        transform to_world;
+        transform to_object;
+};
+
+__device__ bool instance::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    ray local(to_object.point(r.origin()), to_object.vector(r.direction()));
+    bool hit = object->hit(local, t_min, t_max, rec);
+#ifdef RT_PROFILE
+    r.tests += local.tests;
+#endif
+    if (!hit)
+        return false;
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = unit_vector(to_object.vector_transposed(rec.normal));
+    return true;
+}
+
+__device__ bool instance::bounding_box(aabb& box) const {
+    aabb local;
+    if (!object->bounding_box(local))
+        return false;
+    box = empty_box();
+    for (int corner = 0; corner < 8; corner++) {
+        vec3 p((corner & 1) ? local.max().x() : local.min().x(),
+               (corner & 2) ? local.max().y() : local.min().y(),
+               (corner & 4) ? local.max().z() : local.min().z());
+        p = to_world.point(p);
+        box = surrounding_box(box, aabb(p, p));
+    }
+    return true;
+}
+
+#endif
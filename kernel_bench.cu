@@ -0,0 +1,292 @@
+// Device microbenchmark of the render's building blocks in isolation:
+// sphere::hit through the virtual call and hit_sphere inlined,
+// hitable_list::hit over BENCH_LIST spheres, the scatter of each material,
+// schlick, refract and camera::get_ray.  Each runs one thread per element
+// of a pre-generated batch of BENCH_COUNT rays at the unit sphere:
+//   hit      aimed within 0.9 radii of the center
+//   miss     passing 1.5 to 3 radii from the center
+//   grazing  passing within 0.1% of the radius from the edge
+// The scatter, schlick and refract inputs are where each ray meets the
+// sphere, or passes closest to it.  Every launch is timed BENCH_REPS times
+// with CUDA events; the ns per op are the launch time over BENCH_COUNT and
+// include loading the input and storing one float.  `make bench_kernels`.
+#include <float.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <curand_kernel.h>
+#include "check_cuda.h"
+#include "vec3.h"
+#include "ray.h"
+#include "sphere.h"
+#include "hitable_list.h"
+#include "camera.h"
+#include "material.h"
+#include "material_set.h"
+
+#define BENCH_COUNT (1 << 20)
+#define BENCH_REPS 21
+#define BENCH_LIST 64
+#define BENCH_BLOCK 256
+
+enum { BATCH_HIT, BATCH_MISS, BATCH_GRAZING, NUM_BATCHES };
+static const char *batch_names[NUM_BATCHES] = { "hit", "miss", "grazing" };
+
+// device arrays of a batch
+struct bench_batch {
+    ray *rays;
+    hit_record *recs;
+    float *cosines;     // of the angle between the reversed ray and the normal
+};
+
+ray bench_ray(std::mt19937& rng, int kind) {
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    float z = 2.0f*uniform(rng) - 1.0f, phi = 2.0f*float(M_PI)*uniform(rng);
+    float s = std::sqrt(1.0f - z*z);
+    vec3 origin = 5.0f*vec3(s*std::cos(phi), s*std::sin(phi), z);
+    vec3 w = unit_vector(-origin);
+    vec3 u = unit_vector(cross(w, std::fabs(w.x()) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0)));
+    vec3 v = cross(w, u);
+    float d = kind == BATCH_HIT ? 0.9f*std::sqrt(uniform(rng)) :
+              kind == BATCH_MISS ? 1.5f + 1.5f*uniform(rng) : 1.0f + 1e-3f*(2.0f*uniform(rng) - 1.0f);
+    float a = 2.0f*float(M_PI)*uniform(rng);
+    return ray(origin, d*(std::cos(a)*u + std::sin(a)*v) - origin);
+}
+
+void bench_batch_alloc(bench_batch& b, int kind, unsigned int seed) {
+    std::mt19937 rng(seed);
+    std::vector<ray> rays(BENCH_COUNT);
+    std::vector<hit_record> recs(BENCH_COUNT);
+    std::vector<float> cosines(BENCH_COUNT);
+    for (int i = 0; i < BENCH_COUNT; i++) {
+        ray r = bench_ray(rng, kind);
+        float t;
+        if (!hit_sphere(vec3(0, 0, 0), 1.0f, r, 0.001f, FLT_MAX, t))
+            t = -dot(r.origin(), r.direction()) / dot(r.direction(), r.direction());
+        rays[i] = r;
+        recs[i].t = t;
+        recs[i].p = r.point_at_parameter(t);
+        recs[i].normal = unit_vector(recs[i].p);
+        recs[i].mat_ptr = NULL;
+        recs[i].prim_id = 0;
+        cosines[i] = -dot(unit_vector(r.direction()), recs[i].normal);
+    }
+    checkCudaErrors(cudaMalloc((void **)&b.rays, BENCH_COUNT*sizeof(ray)));
+    checkCudaErrors(cudaMalloc((void **)&b.recs, BENCH_COUNT*sizeof(hit_record)));
+    checkCudaErrors(cudaMalloc((void **)&b.cosines, BENCH_COUNT*sizeof(float)));
+    checkCudaErrors(cudaMemcpy(b.rays, rays.data(), BENCH_COUNT*sizeof(ray), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(b.recs, recs.data(), BENCH_COUNT*sizeof(hit_record), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(b.cosines, cosines.data(), BENCH_COUNT*sizeof(float), cudaMemcpyHostToDevice));
+}
+
+void bench_batch_free(bench_batch& b) {
+    checkCudaErrors(cudaFree(b.rays));
+    checkCudaErrors(cudaFree(b.recs));
+    checkCudaErrors(cudaFree(b.cosines));
+}
+
+// list[0] is the unit sphere, the rest small spheres around it that the
+// rays have to be tested against too
+__global__ void create_bench_objects(hitable **list, hitable **world, material **mats, camera **cam,
+                                     unsigned int seed) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        mats[MAT_LAMBERTIAN] = new lambertian(vec3(0.5, 0.5, 0.5));
+        mats[MAT_METAL] = new metal(vec3(0.7, 0.6, 0.5), 0.1f);
+        mats[MAT_DIELECTRIC] = new dielectric(1.5f);
+        curandState local_rand_state;
+        curand_init(seed, 0, 0, &local_rand_state);
+        list[0] = new sphere(vec3(0, 0, 0), 1.0f, mats[MAT_LAMBERTIAN], 0);
+        for (int i = 1; i < BENCH_LIST; i++) {
+            vec3 c(curand_uniform(&local_rand_state), curand_uniform(&local_rand_state),
+                   curand_uniform(&local_rand_state));
+            list[i] = new sphere(8.0f*c - vec3(4, 4, 4), 0.2f, mats[MAT_LAMBERTIAN], i);
+        }
+        *world = new hitable_list(list, BENCH_LIST);
+        *cam = new camera(vec3(13, 2, 3), vec3(0, 0, 0), vec3(0, 1, 0), 30.0f, 1.5f, 0.1f, 10.0f);
+    }
+}
+
+__global__ void free_bench_objects(hitable **list, hitable **world, material **mats, camera **cam) {
+    for (int i = 0; i < BENCH_LIST; i++)
+        delete list[i];
+    for (int k = 0; k < 3; k++)
+        delete mats[k];
+    delete *world;
+    delete *cam;
+}
+
+__global__ void bench_rand_init(sample_rng *states, unsigned int seed) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < BENCH_COUNT)
+        sample_rng_init(&states[i], seed, i, 0);
+}
+
+// the operations, each returns something of its result so it is kept
+struct sphere_hit_op {
+    hitable **list;
+    const ray *rays;
+    __device__ float operator()(int i) const {
+        hit_record rec;
+        return list[0]->hit(rays[i], 0.001f, FLT_MAX, rec) ? rec.t : 0.0f;
+    }
+};
+
+struct hit_sphere_op {
+    vec3 center;
+    float radius;
+    const ray *rays;
+    __device__ float operator()(int i) const {
+        float t;
+        return hit_sphere(center, radius, rays[i], 0.001f, FLT_MAX, t) ? t : 0.0f;
+    }
+};
+
+struct list_hit_op {
+    hitable **world;
+    const ray *rays;
+    __device__ float operator()(int i) const {
+        hit_record rec;
+        return (*world)->hit(rays[i], 0.001f, FLT_MAX, rec) ? rec.t : 0.0f;
+    }
+};
+
+template <typename M>
+struct scatter_op {
+    material **mats;
+    const ray *rays;
+    const hit_record *recs;
+    sample_rng *states;
+    __device__ float operator()(int i) const {
+        sample_rng local_rand_state = states[i];
+        vec3 attenuation;
+        ray scattered;
+        bool s = material_set<M>::scatter(mats[M::KIND], rays[i], recs[i], attenuation, scattered, &local_rand_state);
+        states[i] = local_rand_state;
+        return s ? scattered.direction().x() + attenuation.x() : 0.0f;
+    }
+};
+
+struct schlick_op {
+    const float *cosines;
+    __device__ float operator()(int i) const { return schlick(cosines[i], 1.5f); }
+};
+
+struct refract_op {
+    const ray *rays;
+    const hit_record *recs;
+    __device__ float operator()(int i) const {
+        vec3 refracted;
+        return refract(rays[i].direction(), recs[i].normal, 1.0f/1.5f, refracted) ? refracted.x() : 0.0f;
+    }
+};
+
+struct get_ray_op {
+    camera **cam;
+    sample_rng *states;
+    __device__ float operator()(int i) const {
+        sample_rng local_rand_state = states[i];
+        float u = ((i & 1023) + 0.5f) / 1024.0f;
+        float v = ((i >> 10 & 1023) + 0.5f) / 1024.0f;
+        ray r = (*cam)->get_ray(u, v, &local_rand_state);
+        states[i] = local_rand_state;
+        return r.direction().x();
+    }
+};
+
+template <typename OP>
+__global__ void bench_kernel(OP op, float *sink) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < BENCH_COUNT)
+        sink[i] = op(i);
+}
+
+// median and best of BENCH_REPS launches after a warm-up one, and the
+// spread between runs as the standard deviation over the mean
+template <typename OP>
+void bench(const char *name, const char *batch, OP op, float *sink) {
+    int blocks = (BENCH_COUNT + BENCH_BLOCK-1) / BENCH_BLOCK;
+    bench_kernel<<<blocks, BENCH_BLOCK>>>(op, sink);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    cudaEvent_t start, stop;
+    checkCudaErrors(cudaEventCreate(&start));
+    checkCudaErrors(cudaEventCreate(&stop));
+    std::vector<double> ns(BENCH_REPS);
+    for (int rep = 0; rep < BENCH_REPS; rep++) {
+        checkCudaErrors(cudaEventRecord(start));
+        bench_kernel<<<blocks, BENCH_BLOCK>>>(op, sink);
+        checkCudaErrors(cudaEventRecord(stop));
+        checkCudaErrors(cudaEventSynchronize(stop));
+        checkCudaErrors(cudaGetLastError());
+        float ms;
+        checkCudaErrors(cudaEventElapsedTime(&ms, start, stop));
+        ns[rep] = ms*1e6 / BENCH_COUNT;
+    }
+    checkCudaErrors(cudaEventDestroy(start));
+    checkCudaErrors(cudaEventDestroy(stop));
+    double mean = 0.0, var = 0.0;
+    for (int rep = 0; rep < BENCH_REPS; rep++) mean += ns[rep] / BENCH_REPS;
+    for (int rep = 0; rep < BENCH_REPS; rep++) var += (ns[rep] - mean)*(ns[rep] - mean) / BENCH_REPS;
+    std::sort(ns.begin(), ns.end());
+    printf("%-22s %-8s %8.4f ns  (best %.4f, +-%.1f%%)\n", name, batch, ns[BENCH_REPS/2], ns[0],
+           100.0*std::sqrt(var)/mean);
+}
+
+int main() {
+    hitable **list, **world;
+    material **mats;
+    camera **cam;
+    checkCudaErrors(cudaMalloc((void **)&list, BENCH_LIST*sizeof(hitable *)));
+    checkCudaErrors(cudaMalloc((void **)&world, sizeof(hitable *)));
+    checkCudaErrors(cudaMalloc((void **)&mats, 3*sizeof(material *)));
+    checkCudaErrors(cudaMalloc((void **)&cam, sizeof(camera *)));
+    create_bench_objects<<<1,1>>>(list, world, mats, cam, 1984);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+
+    sample_rng *states;
+    float *sink;
+    checkCudaErrors(cudaMalloc((void **)&states, BENCH_COUNT*sizeof(sample_rng)));
+    checkCudaErrors(cudaMalloc((void **)&sink, BENCH_COUNT*sizeof(float)));
+    bench_rand_init<<<(BENCH_COUNT + BENCH_BLOCK-1) / BENCH_BLOCK, BENCH_BLOCK>>>(states, 1984);
+    checkCudaErrors(cudaGetLastError());
+
+    printf("%d ops per launch, median of %d launches\n", BENCH_COUNT, BENCH_REPS);
+    for (int kind = 0; kind < NUM_BATCHES; kind++) {
+        bench_batch b;
+        bench_batch_alloc(b, kind, 1984 + kind);
+        const char *name = batch_names[kind];
+        sphere_hit_op sphere_hit = { list, b.rays };
+        hit_sphere_op inline_hit = { vec3(0, 0, 0), 1.0f, b.rays };
+        list_hit_op list_hit = { world, b.rays };
+        scatter_op<lambertian> lambertian_scatter = { mats, b.rays, b.recs, states };
+        scatter_op<metal> metal_scatter = { mats, b.rays, b.recs, states };
+        scatter_op<dielectric> dielectric_scatter = { mats, b.rays, b.recs, states };
+        schlick_op schlick_cos = { b.cosines };
+        refract_op refract_n = { b.rays, b.recs };
+        bench("sphere::hit", name, sphere_hit, sink);
+        bench("hit_sphere (inlined)", name, inline_hit, sink);
+        bench("hitable_list::hit", name, list_hit, sink);
+        bench("lambertian::scatter", name, lambertian_scatter, sink);
+        bench("metal::scatter", name, metal_scatter, sink);
+        bench("dielectric::scatter", name, dielectric_scatter, sink);
+        bench("schlick", name, schlick_cos, sink);
+        bench("refract", name, refract_n, sink);
+        bench_batch_free(b);
+    }
+    get_ray_op get_ray = { cam, states };
+    bench("camera::get_ray", "-", get_ray, sink);
+
+    free_bench_objects<<<1,1>>>(list, world, mats, cam);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    checkCudaErrors(cudaFree(list));
+    checkCudaErrors(cudaFree(world));
+    checkCudaErrors(cudaFree(mats));
+    checkCudaErrors(cudaFree(cam));
+    checkCudaErrors(cudaFree(states));
+    checkCudaErrors(cudaFree(sink));
+    cudaDeviceReset();
+}
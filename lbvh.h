@@ -0,0 +1,299 @@
+#ifndef LBVHH
+#define LBVHH
+
+#include <thrust/device_ptr.h>
+#include <thrust/reduce.h>
+#include <thrust/sort.h>
+#include <thrust/transform_reduce.h>
+#include <thrust/functional.h>
+#include "check_cuda.h"
+#include "mem_usage.h"
+#include "bvh.h"
+
+// Linear BVH builder after Karras, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees" (HPG 2012).  Primitives are
+// ordered along a Morton curve through their box centers, every internal node
+// is then emitted independently from the sorted codes, and finally the boxes
+// are fitted bottom-up.  All stages run on the GPU, so rebuilding a scene of
+// millions of spheres takes milliseconds and can be done every frame.
+
+#define LBVH_BLOCK 256
+
+// spreads the low 10 (21) bits of v so that there are two zero bits between each
+__device__ inline unsigned int expand_bits(unsigned int v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+__device__ inline unsigned long long expand_bits(unsigned long long v) {
+    v = (v | v << 32) & 0x001f00000000ffffull;
+    v = (v | v << 16) & 0x001f0000ff0000ffull;
+    v = (v | v <<  8) & 0x100f00f00f00f00full;
+    v = (v | v <<  4) & 0x10c30c30c30c30c3ull;
+    v = (v | v <<  2) & 0x1249249249249249ull;
+    return v;
+}
+
+// 30-bit (unsigned int) or 63-bit (unsigned long long) Morton code of a point in the unit cube
+template <typename code_t>
+__device__ inline code_t morton_code(vec3 p) {
+    const int bits = sizeof(code_t) == 4 ? 10 : 21;
+    const float scale = float(1 << bits);
+    code_t x = code_t(fminf(fmaxf(p.x() * scale, 0.0f), scale - 1.0f));
+    code_t y = code_t(fminf(fmaxf(p.y() * scale, 0.0f), scale - 1.0f));
+    code_t z = code_t(fminf(fmaxf(p.z() * scale, 0.0f), scale - 1.0f));
+    return expand_bits(x) * 4 + expand_bits(y) * 2 + expand_bits(z);
+}
+
+__device__ inline int count_leading_zeros(unsigned int v) { return __clz(v); }
+__device__ inline int count_leading_zeros(unsigned long long v) { return __clzll(v); }
+
+// length of the common prefix of sorted keys i and j, -1 if j is out of
+// range.  Equal codes are made unique by appending the key index.
+template <typename code_t>
+__device__ inline int lbvh_delta(const code_t *codes, int n, int i, int j) {
+    if (j < 0 || j >= n) return -1;
+    code_t a = codes[i];
+    code_t b = codes[j];
+    if (a == b) return 8*int(sizeof(code_t)) + __clz(i ^ j);
+    return count_leading_zeros(a ^ b);
+}
+
+__global__ void lbvh_gather_boxes(hitable **list, int n, aabb *boxes) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= n) return;
+    if (!list[i]->bounding_box(boxes[i]))
+        boxes[i] = empty_box();
+}
+
+struct aabb_union {
+    __host__ __device__ aabb operator()(const aabb& a, const aabb& b) const { return surrounding_box(a, b); }
+};
+
+template <typename code_t>
+__global__ void lbvh_morton_codes(const aabb *boxes, int n, aabb scene, code_t *codes, int *order) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= n) return;
+    vec3 extent = scene.max() - scene.min();
+    vec3 c = boxes[i].center() - scene.min();
+    vec3 p(extent.x() > 0.0f ? c.x() / extent.x() : 0.5f,
+           extent.y() > 0.0f ? c.y() / extent.y() : 0.5f,
+           extent.z() > 0.0f ? c.z() / extent.z() : 0.5f);
+    codes[i] = morton_code<code_t>(p);
+    order[i] = i;
+}
+
+// one thread per sorted key: writes leaf i and, for i < n-1, finds the key
+// range and split position of internal node i
+template <typename code_t>
+__global__ void lbvh_build_hierarchy(const code_t *codes, const int *order, const aabb *boxes, int n, bvh_node *nodes) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= n) return;
+    bvh_node& leaf = nodes[n-1 + i];
+    leaf.box = boxes[order[i]];
+    leaf.left = order[i];
+    leaf.right = -1;
+    if (n == 1) leaf.parent = -1;
+    if (i == n-1) return;
+
+    // direction of the range and its other end
+    int d = lbvh_delta(codes, n, i, i+1) - lbvh_delta(codes, n, i, i-1) >= 0 ? 1 : -1;
+    int delta_min = lbvh_delta(codes, n, i, i-d);
+    int l_max = 2;
+    while (lbvh_delta(codes, n, i, i + l_max*d) > delta_min)
+        l_max *= 2;
+    int l = 0;
+    for (int t = l_max/2; t >= 1; t /= 2) {
+        if (lbvh_delta(codes, n, i, i + (l+t)*d) > delta_min)
+            l += t;
+    }
+    int j = i + l*d;
+
+    // binary search for the split
+    int delta_node = lbvh_delta(codes, n, i, j);
+    int s = 0;
+    int t = l;
+    do {
+        t = (t+1) / 2;
+        if (lbvh_delta(codes, n, i, i + (s+t)*d) > delta_node)
+            s += t;
+    } while (t > 1);
+    int gamma = i + s*d + (d < 0 ? d : 0);
+
+    int left = (i < j ? i : j) == gamma ? n-1 + gamma : gamma;
+    int right = (i > j ? i : j) == gamma+1 ? n-1 + gamma+1 : gamma+1;
+    nodes[i].left = left;
+    nodes[i].right = right;
+    nodes[left].parent = i;
+    nodes[right].parent = i;
+    if (i == 0) nodes[i].parent = -1;
+}
+
+// bottom-up box fitting, one thread per leaf.  The second thread to reach an
+// internal node computes its box and carries on towards the root.  flags
+// must be zeroed beforehand.
+__global__ void lbvh_fit_bounds(bvh_node *nodes, int n, int *flags) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= n) return;
+    int node = nodes[n-1 + i].parent;
+    while (node != -1) {
+        __threadfence();
+        if (atomicAdd(&flags[node], 1) == 0)
+            return;
+        nodes[node].box = surrounding_box(nodes[nodes[node].left].box, nodes[nodes[node].right].box);
+        node = nodes[node].parent;
+    }
+}
+
+// refit: the leaves take the current boxes of their primitives, the tree
+// topology is kept and only internal boxes are recomputed
+__global__ void lbvh_refit_leaves(hitable **list, bvh_node *nodes, int n) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= n) return;
+    bvh_node& leaf = nodes[n-1 + i];
+    if (!list[leaf.left]->bounding_box(leaf.box))
+        leaf.box = empty_box();
+}
+
+struct bvh_node_area {
+    __host__ __device__ float operator()(const bvh_node& node) const { return node.box.area(); }
+};
+
+struct lbvh {
+    int num_prims;
+    bool morton64;
+    bvh_node *nodes;   // 2*num_prims-1
+    aabb *boxes;       // primitive boxes in list order, the build input
+    void *codes;       // unsigned int or unsigned long long per primitive
+    int *order;
+    int *flags;
+    float build_ms;
+    float refit_ms;
+    float build_sah;   // SAH cost right after the last full build
+};
+
+// SAH cost of the tree, relative to a single primitive intersection
+#define SAH_TRAVERSAL_COST 1.0f
+#define SAH_INTERSECT_COST 1.0f
+
+// default for lbvh_update: rebuild once refitting made the tree 30% worse
+#define LBVH_MAX_SAH_GROWTH 1.3f
+
+// the tree and the build's per primitive arrays, kept for refits
+inline size_t lbvh_bytes(int num_prims, bool morton64) {
+    size_t code = morton64 ? sizeof(unsigned long long) : sizeof(unsigned int);
+    return (2*size_t(num_prims)-1)*sizeof(bvh_node) + num_prims*(sizeof(aabb) + code + 2*sizeof(int));
+}
+
+void lbvh_alloc(lbvh& bvh, int num_prims, bool morton64) {
+    bvh.num_prims = num_prims;
+    bvh.morton64 = morton64;
+    bvh.build_ms = 0.0f;
+    bvh.refit_ms = 0.0f;
+    bvh.build_sah = 0.0f;
+    checkCudaErrors(cudaMalloc((void **)&bvh.nodes, (2*num_prims-1)*sizeof(bvh_node)));
+    checkCudaErrors(cudaMalloc((void **)&bvh.boxes, num_prims*sizeof(aabb)));
+    checkCudaErrors(cudaMalloc((void **)&bvh.codes, num_prims*(morton64 ? sizeof(unsigned long long) : sizeof(unsigned int))));
+    checkCudaErrors(cudaMalloc((void **)&bvh.order, num_prims*sizeof(int)));
+    checkCudaErrors(cudaMalloc((void **)&bvh.flags, num_prims*sizeof(int)));
+    mem_alloc(MEM_ACCEL, lbvh_bytes(num_prims, morton64));
+}
+
+void lbvh_free(lbvh& bvh) {
+    checkCudaErrors(cudaFree(bvh.nodes));
+    checkCudaErrors(cudaFree(bvh.boxes));
+    checkCudaErrors(cudaFree(bvh.codes));
+    checkCudaErrors(cudaFree(bvh.order));
+    checkCudaErrors(cudaFree(bvh.flags));
+    mem_release(MEM_ACCEL, lbvh_bytes(bvh.num_prims, bvh.morton64));
+}
+
+void lbvh_fit(lbvh& bvh) {
+    int blocks = (bvh.num_prims + LBVH_BLOCK-1) / LBVH_BLOCK;
+    checkCudaErrors(cudaMemset(bvh.flags, 0, bvh.num_prims*sizeof(int)));
+    lbvh_fit_bounds<<<blocks, LBVH_BLOCK>>>(bvh.nodes, bvh.num_prims, bvh.flags);
+    checkCudaErrors(cudaGetLastError());
+}
+
+float lbvh_sah_cost(const lbvh& bvh) {
+    int n = bvh.num_prims;
+    thrust::device_ptr<bvh_node> nodes(bvh.nodes);
+    float inner = thrust::transform_reduce(nodes, nodes + (n-1), bvh_node_area(), 0.0f, thrust::plus<float>());
+    float leaves = thrust::transform_reduce(nodes + (n-1), nodes + (2*n-1), bvh_node_area(), 0.0f, thrust::plus<float>());
+    bvh_node root;
+    checkCudaErrors(cudaMemcpy(&root, bvh.nodes, sizeof(bvh_node), cudaMemcpyDeviceToHost));
+    float root_area = root.box.area();
+    if (root_area <= 0.0f) return 0.0f;
+    return (SAH_TRAVERSAL_COST*inner + SAH_INTERSECT_COST*leaves) / root_area;
+}
+
+template <typename code_t>
+void lbvh_build_with(lbvh& bvh) {
+    int n = bvh.num_prims;
+    int blocks = (n + LBVH_BLOCK-1) / LBVH_BLOCK;
+    code_t *codes = (code_t *)bvh.codes;
+    thrust::device_ptr<aabb> boxes(bvh.boxes);
+    aabb scene = thrust::reduce(boxes, boxes + n, empty_box(), aabb_union());
+    lbvh_morton_codes<code_t><<<blocks, LBVH_BLOCK>>>(bvh.boxes, n, scene, codes, bvh.order);
+    checkCudaErrors(cudaGetLastError());
+    // thrust picks a radix sort for integer keys
+    thrust::sort_by_key(thrust::device_ptr<code_t>(codes), thrust::device_ptr<code_t>(codes + n),
+                        thrust::device_ptr<int>(bvh.order));
+    lbvh_build_hierarchy<code_t><<<blocks, LBVH_BLOCK>>>(codes, bvh.order, bvh.boxes, n, bvh.nodes);
+    checkCudaErrors(cudaGetLastError());
+    lbvh_fit(bvh);
+}
+
+// builds from the boxes already in bvh.boxes
+void lbvh_build(lbvh& bvh) {
+    cudaEvent_t start, stop;
+    checkCudaErrors(cudaEventCreate(&start));
+    checkCudaErrors(cudaEventCreate(&stop));
+    checkCudaErrors(cudaEventRecord(start));
+    if (bvh.morton64) lbvh_build_with<unsigned long long>(bvh);
+    else lbvh_build_with<unsigned int>(bvh);
+    checkCudaErrors(cudaEventRecord(stop));
+    checkCudaErrors(cudaEventSynchronize(stop));
+    checkCudaErrors(cudaEventElapsedTime(&bvh.build_ms, start, stop));
+    checkCudaErrors(cudaEventDestroy(start));
+    checkCudaErrors(cudaEventDestroy(stop));
+    bvh.build_sah = lbvh_sah_cost(bvh);
+}
+
+// builds over the primitives of a device hitable list
+void lbvh_build(lbvh& bvh, hitable **d_list) {
+    int blocks = (bvh.num_prims + LBVH_BLOCK-1) / LBVH_BLOCK;
+    lbvh_gather_boxes<<<blocks, LBVH_BLOCK>>>(d_list, bvh.num_prims, bvh.boxes);
+    checkCudaErrors(cudaGetLastError());
+    lbvh_build(bvh);
+}
+
+// refits the tree to the moved primitives of d_list.  Returns true if that
+// grew the SAH cost beyond max_sah_growth times its value after the last
+// build, in which case the tree has been rebuilt instead.  The nodes array is
+// reused, so a bvh hitable created over it stays valid either way.
+bool lbvh_update(lbvh& bvh, hitable **d_list, float max_sah_growth) {
+    cudaEvent_t start, stop;
+    checkCudaErrors(cudaEventCreate(&start));
+    checkCudaErrors(cudaEventCreate(&stop));
+    checkCudaErrors(cudaEventRecord(start));
+    int blocks = (bvh.num_prims + LBVH_BLOCK-1) / LBVH_BLOCK;
+    lbvh_refit_leaves<<<blocks, LBVH_BLOCK>>>(d_list, bvh.nodes, bvh.num_prims);
+    checkCudaErrors(cudaGetLastError());
+    lbvh_fit(bvh);
+    checkCudaErrors(cudaEventRecord(stop));
+    checkCudaErrors(cudaEventSynchronize(stop));
+    checkCudaErrors(cudaEventElapsedTime(&bvh.refit_ms, start, stop));
+    checkCudaErrors(cudaEventDestroy(start));
+    checkCudaErrors(cudaEventDestroy(stop));
+
+    if (lbvh_sah_cost(bvh) <= max_sah_growth * bvh.build_sah)
+        return false;
+    lbvh_build(bvh, d_list);
+    return true;
+}
+
+#endif
@@ -1,138 +1,416 @@
 #include <iostream>
 #include <time.h>
 #include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
 #include <curand_kernel.h>
+#include "check_cuda.h"
 #include "vec3.h"
 #include "ray.h"
 #include "sphere.h"
 #include "hitable_list.h"
 #include "camera.h"
 #include "material.h"
-
-// limited version of checkCudaErrors from helper_cuda.h in CUDA examples
-#define checkCudaErrors(val) check_cuda( (val), #val, __FILE__, __LINE__ )
-
-void check_cuda(cudaError_t result, char const *const func, const char *const file, int const line) {
-    if (result) {
-        std::cerr << "CUDA error = " << static_cast<unsigned int>(result) << " at " <<
-            file << ":" << line << " '" << func <<" "<<cudaGetErrorString(result)<< "' \n";
-        // Make sure we call CUDA Device Reset before exiting
-        cudaDeviceReset();
-        exit(99);
-    }
-}
+#include "material_set.h"
+#include "aov.h"
+#include "lbvh.h"
+#include "bvh4.h"
+#include "qbvh4.h"
+#include "instance.h"
+#include "triangle_mesh.h"
+#include "mesh_loader.h"
+#include "wavefront.h"
+#include "tile_order.h"
+#include "autotune.h"
+#include "config.h"
+#include "framebuffer.h"
+#include "animation.h"
+#include "render_server.h"
+#include "profile.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "mem_usage.h"
 
 // Matching the C++ code would recurse enough into color() calls that
 // it was blowing up the stack, so we have to turn this into a
 // limited-depth loop instead.  Later code in the book limits to a max
 // depth of 50, so we adapt this a few chapters early on the GPU.
-__device__ vec3 color(const ray& r, hitable **world, curandState *local_rand_state) {
+// The limit is MAX_DEPTH when that is nonzero, so the common depths get a
+// loop with a constant bound, and max_depth otherwise.  Materials are
+// dispatched over the compile-time set MATERIALS instead of virtually.
+// *num_rays is incremented for every ray traced, and the path's bounces go
+// into *pixel for the profiler (profile.h).  If first_hit is non-NULL it
+// receives the camera ray's hit record for the AOVs, and *first_hit_valid
+// says whether the camera ray hit anything.
+template <int MAX_DEPTH, typename MATERIALS>
+__device__ vec3 color(const ray& r, hitable **world, sample_rng *local_rand_state, int *num_rays, path_stats *pixel,
+                      int max_depth, hit_record *first_hit = NULL, bool *first_hit_valid = NULL) {
+    const int depth = MAX_DEPTH > 0 ? MAX_DEPTH : max_depth;
     ray cur_ray = r;
     vec3 cur_attenuation = vec3(1.0,1.0,1.0);
-    for(int i = 0; i < 50; i++) {
+    path_stats path;
+    if (first_hit_valid) *first_hit_valid = false;
+    for(int i = 0; i < depth; i++) {
         hit_record rec;
+        (*num_rays)++;
+        long long bounce_start = profile_clock();
         if ((*world)->hit(cur_ray, 0.001f, FLT_MAX, rec)) {
+            if (i == 0 && first_hit) {
+                *first_hit = rec;
+                *first_hit_valid = true;
+            }
             ray scattered;
             vec3 attenuation;
-            if(rec.mat_ptr->scatter(cur_ray, rec, attenuation, scattered, local_rand_state)) {
+            bool scatters = MATERIALS::scatter(rec.mat_ptr, cur_ray, rec, attenuation, scattered, local_rand_state);
+            profile_bounce(path, cur_ray, rec.mat_ptr->kind, bounce_start);
+            if(scatters) {
                 cur_attenuation *= attenuation;
                 cur_ray = scattered;
             }
             else {
+                profile_path(*pixel, path);
                 return vec3(0.0,0.0,0.0);
             }
         }
         else {
-            vec3 unit_direction = unit_vector(cur_ray.direction());
-            float t = 0.5f*(unit_direction.y() + 1.0f);
-            vec3 c = (1.0f-t)*vec3(1.0, 1.0, 1.0) + t*vec3(0.5, 0.7, 1.0);
-            return cur_attenuation * c;
+            profile_bounce(path, cur_ray, PROFILE_SKY, bounce_start);
+            profile_path(*pixel, path);
+            // rounded like the wavefront renderer's sum, see mul_rn()
+            return mul_rn(cur_attenuation, sky_color(cur_ray));
         }
     }
+    profile_path(*pixel, path);
     return vec3(0.0,0.0,0.0); // exceeded recursion
 }
 
-__global__ void rand_init(curandState *rand_state) {
+__global__ void rand_init(curandState *rand_state, unsigned int seed) {
     if (threadIdx.x == 0 && blockIdx.x == 0) {
-        curand_init(1984, 0, 0, rand_state);
+        curand_init(seed, 0, 0, rand_state);
     }
 }
 
-__global__ void render_init(int max_x, int max_y, curandState *rand_state) {
-    int i = threadIdx.x + blockIdx.x * blockDim.x;
-    int j = threadIdx.y + blockIdx.y * blockDim.y;
-    if((i >= max_x) || (j >= max_y)) return;
+// Samples first_sample to first_sample+ns-1 of pixel (i, j), whose random
+// numbers are those of pixel first_stream + j*max_x + i (see sample_rng.h).
+template <int MAX_DEPTH, typename MATERIALS>
+__device__ void render_pixel(int i, int j, framebuffer fb, int max_x, int max_y, int ns, int max_depth, camera **cam,
+                             hitable **world, unsigned int seed, int first_sample, int first_stream, aov_buffers aov,
+                             int *num_rays) {
     int pixel_index = j*max_x + i;
-    // Original: Each thread gets same seed, a different sequence number, no offset
-    // curand_init(1984, pixel_index, 0, &rand_state[pixel_index]);
-    // BUGFIX, see Issue#2: Each thread gets different seed, same sequence for
-    // performance improvement of about 2x!
-    curand_init(1984+pixel_index, 0, 0, &rand_state[pixel_index]);
-}
-
-__global__ void render(vec3 *fb, int max_x, int max_y, int ns, camera **cam, hitable **world, curandState *rand_state) {
-    int i = threadIdx.x + blockIdx.x * blockDim.x;
-    int j = threadIdx.y + blockIdx.y * blockDim.y;
-    if((i >= max_x) || (j >= max_y)) return;
-    int pixel_index = j*max_x + i;
-    curandState local_rand_state = rand_state[pixel_index];
     vec3 col(0,0,0);
+    path_stats pixel;
+    long long pixel_start = profile_clock();
     for(int s=0; s < ns; s++) {
+        sample_rng local_rand_state;
+        sample_rng_init(&local_rand_state, seed, first_stream + pixel_index, first_sample + s);
         float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
         float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
         ray r = (*cam)->get_ray(u, v, &local_rand_state);
-        col += color(r, world, &local_rand_state);
+        if (aov.albedo) {
+            hit_record first_hit;
+            bool first_hit_valid;
+            col += color<MAX_DEPTH, MATERIALS>(r, world, &local_rand_state, num_rays, &pixel, max_depth, &first_hit,
+                                               &first_hit_valid);
+            aov_accumulate(&first_hit, first_hit_valid, s, ns, aov, pixel_index, max_x*max_y);
+        }
+        else {
+            col += color<MAX_DEPTH, MATERIALS>(r, world, &local_rand_state, num_rays, &pixel, max_depth);
+        }
+    }
+    profile_pixel(pixel_index, pixel, pixel_start);
+    if (aov.albedo) aov_store_color(col, ns, aov, pixel_index, max_x*max_y);
+    fb_add_samples(fb, pixel_index, col, ns);
+}
+
+// Renders pixel (i, j) of the view'th of num_views images.  The views have
+// their own cameras and images, back to back in cam and fb, and random
+// numbers like the rows of one tall image, so the first view draws exactly
+// those of a single render.
+template <int MAX_DEPTH, typename MATERIALS>
+__device__ void render_view_pixel(int view, int i, int j, framebuffer fb, int max_x, int max_y, int ns, int max_depth,
+                                  camera **cam, hitable **world, unsigned int seed, int first_sample, aov_buffers aov,
+                                  int *num_rays) {
+    int num_pixels = max_x*max_y;
+    render_pixel<MAX_DEPTH, MATERIALS>(i, j, fb_view(fb, view, num_pixels), max_x, max_y, ns, max_depth, cam + view,
+                                       world, seed, first_sample, view*num_pixels, aov, num_rays);
+}
+
+// Adds the rays of the block's threads to *ray_count with one atomic per
+// block: shuffles sum each warp, thread 0 the warps.  Every thread of the
+// block has to get here, the last warp may be partial.
+__device__ inline void block_add_rays(unsigned long long *ray_count, int num_rays) {
+    __shared__ int warp_rays[32];
+    unsigned int mask = __activemask();
+    for (int offset = 16; offset > 0; offset /= 2) {
+        int other = __shfl_down_sync(mask, num_rays, offset);
+        if (threadIdx.x + offset < blockDim.x) num_rays += other;
+    }
+    if (threadIdx.x % 32 == 0) warp_rays[threadIdx.x / 32] = num_rays;
+    __syncthreads();
+    if (threadIdx.x == 0) {
+        unsigned long long sum = 0;
+        for (int w = 0; w < (blockDim.x + 31) / 32; w++) sum += warp_rays[w];
+        atomicAdd(ray_count, sum);
+    }
+}
+
+// Block b renders tile b / num_views of view b % num_views, so the views
+// take turns tile by tile and all of them are in flight at once.
+template <int MAX_DEPTH, typename MATERIALS>
+__global__ void render(framebuffer fb, int max_x, int max_y, int ns, int max_depth, camera **cam, hitable **world,
+                       unsigned int seed, int first_sample, aov_buffers aov, unsigned long long *ray_count, tile_layout layout,
+                       int num_views) {
+    unsigned long long start = trace_clock();
+    int i, j;
+    int num_rays = 0;
+    tile_pixel(layout, blockIdx.x / num_views, i, j);
+    if ((i < max_x) && (j < max_y) && !tile_pixel_skipped(layout, i, j))
+        render_view_pixel<MAX_DEPTH, MATERIALS>(blockIdx.x % num_views, i, j, fb, max_x, max_y, ns, max_depth, cam,
+                                                world, seed, first_sample, aov, &num_rays);
+    block_add_rays(ray_count, num_rays);
+    trace_tile_done(start, blockIdx.x / num_views);
+}
+
+// SCHEDULE_PERSISTENT: the blocks loop, taking the next tile off *next_tile
+template <int MAX_DEPTH, typename MATERIALS>
+__global__ void render_persistent(framebuffer fb, int max_x, int max_y, int ns, int max_depth, camera **cam, hitable **world,
+                                  unsigned int seed, int first_sample, aov_buffers aov, unsigned long long *ray_count,
+                                  tile_layout layout, int num_views, int *next_tile) {
+    __shared__ int tile;
+    int num_tiles = tile_layout_count(layout)*num_views;
+    int num_rays = 0;
+    while (true) {
+        if (threadIdx.x == 0) tile = atomicAdd(next_tile, 1);
+        __syncthreads();
+        int slot = tile;
+        __syncthreads();
+        if (slot >= num_tiles) break;
+        unsigned long long start = trace_clock();
+        int i, j;
+        tile_pixel(layout, slot / num_views, i, j);
+        if ((i < max_x) && (j < max_y) && !tile_pixel_skipped(layout, i, j))
+            render_view_pixel<MAX_DEPTH, MATERIALS>(slot % num_views, i, j, fb, max_x, max_y, ns, max_depth, cam, world,
+                                                    seed, first_sample, aov, &num_rays);
+        trace_tile_done(start, slot / num_views);
+    }
+    block_add_rays(ray_count, num_rays);
+}
+
+template <int MAX_DEPTH, typename MATERIALS>
+void launch_render_kernel(const render_params& params, const tile_layout& layout, const framebuffer& fb, const render_config& cfg,
+                          camera **cam, hitable **world, int first_sample, aov_buffers aov,
+                          unsigned long long *ray_count, int num_views) {
+    int phase = trace_begin("render kernel");
+    trace_next_launch();
+    if (params.schedule == SCHEDULE_PERSISTENT) {
+        int device, num_sms;
+        checkCudaErrors(cudaGetDevice(&device));
+        checkCudaErrors(cudaDeviceGetAttribute(&num_sms, cudaDevAttrMultiProcessorCount, device));
+        int *next_tile;
+        checkCudaErrors(cudaMalloc((void **)&next_tile, sizeof(int)));
+        checkCudaErrors(cudaMemset(next_tile, 0, sizeof(int)));
+        render_persistent<MAX_DEPTH, MATERIALS><<<num_sms*params.blocks_per_sm, tile_layout_threads(layout)>>>(
+            fb, cfg.nx, cfg.ny, cfg.ns, cfg.max_depth, cam, world, cfg.seed, first_sample, aov, ray_count, layout,
+            num_views, next_tile);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        checkCudaErrors(cudaFree(next_tile));
+    }
+    else {
+        render<MAX_DEPTH, MATERIALS><<<tile_layout_blocks(layout, num_views), tile_layout_threads(layout)>>>(
+            fb, cfg.nx, cfg.ny, cfg.ns, cfg.max_depth, cam, world, cfg.seed, first_sample, aov, ray_count, layout,
+            num_views);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+    trace_end(phase);
+}
+
+// picks the smallest material set that covers materials, the scene's
+// scene_material_mask()
+template <int MAX_DEPTH>
+void launch_render_depth(const render_params& params, const tile_layout& layout, const framebuffer& fb, const render_config& cfg,
+                         camera **cam, hitable **world, int materials, int first_sample, aov_buffers aov,
+                         unsigned long long *ray_count, int num_views) {
+    if (!(materials & ~diffuse_materials::mask))
+        launch_render_kernel<MAX_DEPTH, diffuse_materials>(params, layout, fb, cfg, cam, world, first_sample, aov, ray_count, num_views);
+    else if (!(materials & ~opaque_materials::mask))
+        launch_render_kernel<MAX_DEPTH, opaque_materials>(params, layout, fb, cfg, cam, world, first_sample, aov, ray_count, num_views);
+    else
+        launch_render_kernel<MAX_DEPTH, all_materials>(params, layout, fb, cfg, cam, world, first_sample, aov, ray_count, num_views);
+}
+
+// the book's depth and a few common shorter ones get their own kernels.
+// num_views > 1 renders that many views at once, see render().  The
+// samples rendered are cfg.ns from first_sample on, usually the samples
+// fb already has.
+void launch_render(const render_params& params, const tile_layout& layout, const framebuffer& fb, const render_config& cfg,
+                   camera **cam, hitable **world, int materials, int first_sample, aov_buffers aov,
+                   unsigned long long *ray_count, int num_views = 1) {
+    switch (cfg.max_depth) {
+    case 4:  launch_render_depth<4>(params, layout, fb, cfg, cam, world, materials, first_sample, aov, ray_count, num_views); break;
+    case 8:  launch_render_depth<8>(params, layout, fb, cfg, cam, world, materials, first_sample, aov, ray_count, num_views); break;
+    case 16: launch_render_depth<16>(params, layout, fb, cfg, cam, world, materials, first_sample, aov, ray_count, num_views); break;
+    case 50: launch_render_depth<50>(params, layout, fb, cfg, cam, world, materials, first_sample, aov, ray_count, num_views); break;
+    default: launch_render_depth<0>(params, layout, fb, cfg, cam, world, materials, first_sample, aov, ray_count, num_views); break;
     }
-    rand_state[pixel_index] = local_rand_state;
-    col /= float(ns);
-    col[0] = sqrt(col[0]);
-    col[1] = sqrt(col[1]);
-    col[2] = sqrt(col[2]);
-    fb[pixel_index] = col;
+}
+
+// renders the first samples of a frame, so every call traces the same
+// rays, and returns the render time in ms
+float time_render(const render_params& params, const framebuffer& fb, const render_config& cfg, camera **cam, hitable **world,
+                  int materials, unsigned long long *ray_count) {
+    tile_layout layout;
+    tile_layout_build(layout, cfg.nx, cfg.ny, params.tx, params.ty, params.tile_order, params.in_tile_order);
+    aov_buffers no_aov = {};
+    *ray_count = 0;
+    auto start = std::chrono::steady_clock::now();
+    launch_render(params, layout, fb, cfg, cam, world, materials, 0, no_aov, ray_count);
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    tile_layout_free(layout);
+    return ms;
+}
+
+// Renders progressive passes into fb, which needs an accumulation buffer,
+// on top of the samples it already has, until the next pass would end
+// after cfg.time_budget ms.  The first pass takes one sample per pixel and
+// always runs.  Each later pass is twice the last, cut to what the
+// remaining time allows at the last pass's cost per sample, so the
+// estimate follows changes in load, and to CONFIG_MAX_SAMPLES in all.
+// Returns the samples per pixel reached.
+int render_progressive(const render_params& params, const tile_layout& layout, framebuffer& fb,
+                       const render_config& cfg, camera **cam, hitable **world, int materials, unsigned long long *ray_count) {
+    aov_buffers no_aov = {};
+    render_config pass = cfg;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0.0;
+    int passes = 0;
+    for (int pass_samples = 1; pass_samples > 0; passes++) {
+        pass.ns = pass_samples;
+        auto pass_start = std::chrono::steady_clock::now();
+        launch_render(params, layout, fb, pass, cam, world, materials, fb.accum_samples, no_aov, ray_count);
+        auto pass_end = std::chrono::steady_clock::now();
+        double ms_per_sample = std::chrono::duration<double, std::milli>(pass_end - pass_start).count() / pass_samples;
+        elapsed = std::chrono::duration<double, std::milli>(pass_end - start).count();
+        fb.accum_samples += pass_samples;
+        double fit = (cfg.time_budget - elapsed) / fmax(ms_per_sample, 1e-3);
+        fit = fmin(fit, double(CONFIG_MAX_SAMPLES - fb.accum_samples));
+        pass_samples = int(fmax(fmin(fit, 2.0*pass_samples), 0.0));
+    }
+    std::cerr << passes << " passes, " << fb.accum_samples << " samples per pixel in " << elapsed << " of "
+              << cfg.time_budget << " ms.\n";
+    return fb.accum_samples;
+}
+
+// Renders one sample per pixel coarse to fine: first every 8th pixel in x
+// and y, then the rest of every 4th, every 2nd and finally all of them.
+// Each level goes to <prefix><step>.ppm as soon as it is done, the pixels
+// not rendered yet filled in from the corner of their block.  Every pixel
+// is rendered once, so fb, which needs an accumulation buffer, ends up
+// with one sample that a full render builds on.
+#define PREVIEW_COARSEST 8
+
+void render_preview(const render_params& params, framebuffer& fb, const render_config& cfg, camera **cam,
+                    hitable **world, int materials, const char *prefix, unsigned long long *ray_count) {
+    frame_writer writer;
+    frame_writer_start(writer, fb.format, cfg.nx, cfg.ny);
+    render_config pass = cfg;
+    pass.ns = 1;
+    aov_buffers no_aov = {};
+    fb.accum_samples = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int step = PREVIEW_COARSEST; step >= 1; step /= 2) {
+        tile_layout layout;
+        tile_layout_build_level(layout, cfg.nx, cfg.ny, params.tx, params.ty, params.tile_order, params.in_tile_order,
+                                step, step == PREVIEW_COARSEST ? 0 : 2*step);
+        launch_render(params, layout, fb, pass, cam, world, materials, 0, no_aov, ray_count);
+        tile_layout_free(layout);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "preview at 1/" << step << " resolution after " << ms << " ms.\n";
+        frame_writer_submit(writer, fb, std::string(prefix) + std::to_string(step) + ".ppm", step);
+    }
+    frame_writer_finish(writer);
+    fb.accum_samples = 1;
 }
 
 #define RND (curand_uniform(&local_rand_state))
 
-__global__ void create_world(hitable **d_list, hitable **d_world, camera **d_camera, int nx, int ny, curandState *rand_state) {
+__device__ camera *new_camera(const camera_params& p, int nx, int ny) {
+    float focus_dist = p.focus_dist > 0.0f ? p.focus_dist : (p.lookfrom-p.lookat).length();
+    return new camera(p.lookfrom, p.lookat, p.vup, p.vfov, float(nx)/float(ny), p.aperture, focus_dist);
+}
+
+// replaces the camera, all a new frame of an animation changes
+__global__ void set_camera(camera **d_camera, camera_params cam, int nx, int ny) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        delete *d_camera;
+        *d_camera = new_camera(cam, nx, ny);
+    }
+}
+
+__global__ void create_views(camera **d_views, const camera_params *views, int num_views, int nx, int ny) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        for (int v = 0; v < num_views; v++)
+            d_views[v] = new_camera(views[v], nx, ny);
+    }
+}
+
+__global__ void free_views(camera **d_views, int num_views) {
+    for (int v = 0; v < num_views; v++)
+        delete d_views[v];
+}
+
+camera_params book_camera() {
+    camera_params cam = { vec3(13,2,3), vec3(0,0,0), vec3(0,1,0), 30.0f, 0.1f, 10.0f };
+    return cam;
+}
+
+static_assert(22*22+1+3 - 1 <= SPHERE_MAX_ID, "the book scene's sphere ids must fit sphere_id_t");
+
+// with diffuse_only every sphere gets a lambertian material, which lets the
+// renderer run its diffuse-only kernel
+__global__ void create_world(hitable **d_list, hitable **d_world, camera **d_camera, camera_params cam, int nx, int ny,
+                             curandState *rand_state, bool diffuse_only) {
     if (threadIdx.x == 0 && blockIdx.x == 0) {
         curandState local_rand_state = *rand_state;
         d_list[0] = new sphere(vec3(0,-1000.0,-1), 1000,
-                               new lambertian(vec3(0.5, 0.5, 0.5)));
+                               new lambertian(vec3(0.5, 0.5, 0.5)), 0);
         int i = 1;
         for(int a = -11; a < 11; a++) {
             for(int b = -11; b < 11; b++) {
                 float choose_mat = RND;
                 vec3 center(a+RND,0.2,b+RND);
-                if(choose_mat < 0.8f) {
-                    d_list[i++] = new sphere(center, 0.2,
-                                             new lambertian(vec3(RND*RND, RND*RND, RND*RND)));
+                if(choose_mat < 0.8f || diffuse_only) {
+                    d_list[i] = new sphere(center, 0.2,
+                                           new lambertian(vec3(RND*RND, RND*RND, RND*RND)), i);
+                    i++;
                 }
                 else if(choose_mat < 0.95f) {
-                    d_list[i++] = new sphere(center, 0.2,
-                                             new metal(vec3(0.5f*(1.0f+RND), 0.5f*(1.0f+RND), 0.5f*(1.0f+RND)), 0.5f*RND));
+                    d_list[i] = new sphere(center, 0.2,
+                                           new metal(vec3(0.5f*(1.0f+RND), 0.5f*(1.0f+RND), 0.5f*(1.0f+RND)), 0.5f*RND), i);
+                    i++;
                 }
                 else {
-                    d_list[i++] = new sphere(center, 0.2, new dielectric(1.5));
+                    d_list[i] = new sphere(center, 0.2, new dielectric(1.5), i);
+                    i++;
                 }
             }
         }
-        d_list[i++] = new sphere(vec3(0, 1,0),  1.0, new dielectric(1.5));
-        d_list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(vec3(0.4, 0.2, 0.1)));
-        d_list[i++] = new sphere(vec3(4, 1, 0),  1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
+        if (diffuse_only)
+            d_list[i] = new sphere(vec3(0, 1,0),  1.0, new lambertian(vec3(0.9, 0.9, 0.9)), i);
+        else
+            d_list[i] = new sphere(vec3(0, 1,0),  1.0, new dielectric(1.5), i);
+        i++;
+        d_list[i] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(vec3(0.4, 0.2, 0.1)), i); i++;
+        if (diffuse_only)
+            d_list[i] = new sphere(vec3(4, 1, 0),  1.0, new lambertian(vec3(0.7, 0.6, 0.5)), i);
+        else
+            d_list[i] = new sphere(vec3(4, 1, 0),  1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0), i);
+        i++;
         *rand_state = local_rand_state;
         *d_world  = new hitable_list(d_list, 22*22+1+3);
-
-        vec3 lookfrom(13,2,3);
-        vec3 lookat(0,0,0);
-        float dist_to_focus = 10.0; (lookfrom-lookat).length();
-        float aperture = 0.1;
-        *d_camera   = new camera(lookfrom,
-                                 lookat,
-                                 vec3(0,1,0),
-                                 30.0,
-                                 float(nx)/float(ny),
-                                 aperture,
-                                 dist_to_focus);
+        *d_camera = new_camera(cam, nx, ny);
     }
 }
 
@@ -145,83 +423,1122 @@ __global__ void free_world(hitable **d_list, hitable **d_world, camera **d_camer
     delete *d_camera;
 }
 
-int main() {
-    int nx = 1200;
-    int ny = 800;
-    int ns = 20;
-    int tx = 8;
-    int ty = 8;
+// Instanced scene: one cluster of small spheres is built once, with its own
+// BVH, and placed grid*grid times with random rotation and scale on top of
+// the usual ground sphere.  The top level list holds the ground and the
+// instances.
+#define CLUSTER_SIZE 64
+#define INSTANCE_SPACING 3.0f
 
-    std::cerr << "Rendering a " << nx << "x" << ny << " image with " << ns << " samples per pixel ";
-    std::cerr << "in " << tx << "x" << ty << " blocks.\n";
+// the ground takes the id after the cluster's
+static_assert(CLUSTER_SIZE <= SPHERE_MAX_ID, "the cluster's sphere ids must fit sphere_id_t");
 
-    int num_pixels = nx*ny;
-    size_t fb_size = num_pixels*sizeof(vec3);
-
-    // allocate FB
-    vec3 *fb;
-    checkCudaErrors(cudaMallocManaged((void **)&fb, fb_size));
-    
-    // allocate random state
-    curandState *d_rand_state;
-    checkCudaErrors(cudaMalloc((void **)&d_rand_state, num_pixels*sizeof(curandState)));
-    curandState *d_rand_state2;
-    checkCudaErrors(cudaMalloc((void **)&d_rand_state2, 1*sizeof(curandState)));
+__global__ void create_cluster(hitable **d_cluster, curandState *rand_state) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        curandState local_rand_state = *rand_state;
+        for (int i = 0; i < CLUSTER_SIZE; i++) {
+            float angle = 2.0f*float(M_PI)*RND;
+            float dist = 1.2f*sqrt(RND);
+            float radius = 0.1f + 0.15f*RND;
+            vec3 center(dist*cos(angle), radius + 0.6f*RND, dist*sin(angle));
+            float choose_mat = RND;
+            material *m;
+            if (choose_mat < 0.8f) m = new lambertian(vec3(RND*RND, RND*RND, RND*RND));
+            else if (choose_mat < 0.95f) m = new metal(vec3(0.5f*(1.0f+RND), 0.5f*(1.0f+RND), 0.5f*(1.0f+RND)), 0.5f*RND);
+            else m = new dielectric(1.5);
+            d_cluster[i] = new sphere(center, radius, m, i);
+        }
+        *rand_state = local_rand_state;
+    }
+}
 
-    // we need that 2nd random state to be initialized for the world creation
-    rand_init<<<1,1>>>(d_rand_state2);
-    checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaDeviceSynchronize());
+camera_params instanced_camera(int grid) {
+    float extent = INSTANCE_SPACING*grid;
+    camera_params cam = { vec3(0.6f*extent, 0.25f*extent + 2.0f, 0.6f*extent), vec3(0,0,0), vec3(0,1,0), 30.0f, 0.0f, 0.0f };
+    return cam;
+}
 
-    // make our world of hitables & the camera
+__global__ void create_instances(hitable **d_top, hitable **d_blas, hitable **d_world, camera **d_camera,
+                                 camera_params cam, int grid, int nx, int ny, curandState *rand_state) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        curandState local_rand_state = *rand_state;
+        d_top[0] = new sphere(vec3(0,-1000.0,-1), 1000,
+                              new lambertian(vec3(0.5, 0.5, 0.5)), CLUSTER_SIZE);
+        int i = 1;
+        float half = 0.5f*INSTANCE_SPACING*(grid-1);
+        for (int a = 0; a < grid; a++) {
+            for (int b = 0; b < grid; b++) {
+                vec3 offset(a*INSTANCE_SPACING - half, 0.0f, b*INSTANCE_SPACING - half);
+                d_top[i++] = new instance(*d_blas, make_transform(0.8f + 0.4f*RND, 2.0f*float(M_PI)*RND, offset));
+            }
+        }
+        *rand_state = local_rand_state;
+        *d_world = new hitable_list(d_top, grid*grid+1);
+        *d_camera = new_camera(cam, nx, ny);
+    }
+}
+
+__global__ void free_instanced_world(hitable **d_cluster, hitable **d_top, int num_top, hitable **d_world, camera **d_camera) {
+    for (int i = 0; i < CLUSTER_SIZE; i++) {
+        delete ((sphere *)d_cluster[i])->mat_ptr;
+        delete d_cluster[i];
+    }
+    delete ((sphere *)d_top[0])->mat_ptr;
+    for (int i = 0; i < num_top; i++)
+        delete d_top[i];
+    delete *d_world;
+    delete *d_camera;
+}
+
+// Mesh scene: the ground sphere and one triangle mesh, placed by an
+// instance that scales it to a height of about four units
+camera_params mesh_camera() {
+    camera_params cam = { vec3(13,2,3), vec3(0,1.5,0), vec3(0,1,0), 30.0f, 0.0f, 0.0f };
+    return cam;
+}
+
+__global__ void create_mesh_world(hitable **d_list, hitable **d_world, camera **d_camera, mesh_data mesh,
+                                  const bvh_node *mesh_nodes, transform placement, camera_params cam, int nx, int ny) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        d_list[0] = new sphere(vec3(0,-1000.0,-1), 1000,
+                               new lambertian(vec3(0.5, 0.5, 0.5)), -1);
+        hitable *obj = new triangle_mesh(mesh, mesh_nodes, new metal(vec3(0.7, 0.6, 0.5), 0.1));
+        d_list[1] = new instance(obj, placement);
+        *d_world = new hitable_list(d_list, 2);
+        *d_camera = new_camera(cam, nx, ny);
+    }
+}
+
+__global__ void free_mesh_world(hitable **d_list, hitable **d_world, camera **d_camera) {
+    delete ((sphere *)d_list[0])->mat_ptr;
+    delete d_list[0];
+    triangle_mesh *obj = (triangle_mesh *)((instance *)d_list[1])->object;
+    delete obj->mat_ptr;
+    delete obj;
+    delete d_list[1];
+    delete *d_world;
+    delete *d_camera;
+}
+
+// random spheres of radius 0.2 in a cube whose volume grows with n,
+// boxes only, for timing the builder on scenes far larger than ours.  The
+// count is capped so the 2n-1 nodes and the 64-bit codes stay addressable.
+#define LBVH_BENCH_MAX_SPHERES (1 << 28)
+
+__global__ void random_sphere_boxes(aabb *boxes, int n) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= n) return;
+    curandState local_rand_state;
+    curand_init(1984+i, 0, 0, &local_rand_state);
+    float side = cbrtf(float(n));
+    vec3 center = side*vec3(RND, RND, RND);
+    boxes[i] = aabb(center - vec3(0.2, 0.2, 0.2), center + vec3(0.2, 0.2, 0.2));
+}
+
+void lbvh_benchmark(int n) {
+    for (int morton64 = 0; morton64 < 2; morton64++) {
+        lbvh bvh;
+        lbvh_alloc(bvh, n, morton64);
+        random_sphere_boxes<<<(n+LBVH_BLOCK-1)/LBVH_BLOCK, LBVH_BLOCK>>>(bvh.boxes, n);
+        checkCudaErrors(cudaGetLastError());
+        lbvh_build(bvh); // warm up
+        float best_ms = FLT_MAX;
+        for (int rep = 0; rep < 5; rep++) {
+            lbvh_build(bvh);
+            best_ms = fminf(best_ms, bvh.build_ms);
+        }
+        std::cerr << "LBVH " << (morton64 ? 63 : 30) << "-bit Morton codes, " << n << " spheres: "
+                  << best_ms << " ms\n";
+        lbvh_free(bvh);
+    }
+}
+
+// moves every small sphere a step along its own circle around the y axis,
+// at a speed that differs between spheres so the scene slowly shuffles
+__global__ void move_spheres(hitable **d_list, int n) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < 1 || i >= n-3) return;
+    sphere *s = (sphere *)d_list[i];
+    float angle = 0.01f * float(1 + i % 7);
+    float c = cos(angle), sn = sin(angle);
+    s->center = vec3(c*s->center.x() + sn*s->center.z(), s->center.y(), -sn*s->center.x() + c*s->center.z());
+}
+
+void refit_benchmark(lbvh& accel, hitable **d_list, int frames) {
+    int num_hitables = accel.num_prims;
+    for (int f = 0; f < frames; f++) {
+        move_spheres<<<(num_hitables+LBVH_BLOCK-1)/LBVH_BLOCK, LBVH_BLOCK>>>(d_list, num_hitables);
+        checkCudaErrors(cudaGetLastError());
+        bool rebuilt = lbvh_update(accel, d_list, LBVH_MAX_SAH_GROWTH);
+        std::cerr << "frame " << f << ": refit " << accel.refit_ms << " ms, SAH "
+                  << lbvh_sah_cost(accel) << " (built " << accel.build_sah << ")";
+        if (rebuilt) std::cerr << ", rebuilt in " << accel.build_ms << " ms";
+        std::cerr << "\n";
+    }
+}
+
+// A world on the device with its camera and acceleration structure.
+// d_list holds the top level primitives the acceleration structure is
+// built over.
+struct scene {
+    scene_config config;
     hitable **d_list;
-    int num_hitables = 22*22+1+3;
-    checkCudaErrors(cudaMalloc((void **)&d_list, num_hitables*sizeof(hitable *)));
+    int num_hitables;
     hitable **d_world;
-    checkCudaErrors(cudaMalloc((void **)&d_world, sizeof(hitable *)));
     camera **d_camera;
-    checkCudaErrors(cudaMalloc((void **)&d_camera, sizeof(camera *)));
-    create_world<<<1,1>>>(d_list, d_world, d_camera, nx, ny, d_rand_state2);
+    camera_params cam;
+    hitable **d_cluster;
+    hitable **d_blas;
+    lbvh blas;
+    mesh_data mesh;
+    lbvh accel;
+    bvh4_accel accel4;
+    qbvh4_accel qaccel4;
+    hitable **d_bvh;
+    size_t accel_bytes;
+    size_t object_bytes, material_bytes;    // on the device heap, as counted by scene_object_bytes
+    int materials;                          // the kinds of its materials, see scene_material_mask()
+};
+
+// what renders trace against
+inline hitable **scene_world(const scene& s) { return s.d_bvh ? s.d_bvh : s.d_world; }
+
+// top level primitives, what the acceleration structure is built over
+int scene_num_hitables(const scene_config& sc) {
+    if (sc.type == SCENE_MESH) return 2;
+    if (sc.type == SCENE_BOOK) return 22*22+1+3;
+    return sc.instance_grid*sc.instance_grid + 1;
+}
+
+// The objects the creation kernels make with new for the scene, at their
+// sizeof, and the lists of pointers to them.  The book scene's and the
+// cluster's materials are picked at random on the device, so they are
+// counted at the largest kind.
+void scene_object_bytes(const scene_config& sc, size_t& objects, size_t& materials) {
+    int n = scene_num_hitables(sc);
+    size_t largest = std::max(sizeof(lambertian), std::max(sizeof(metal), sizeof(dielectric)));
+    objects = n*sizeof(hitable *) + sizeof(hitable_list) + sizeof(camera);
+    if (sc.type == SCENE_MESH) {
+        objects += sizeof(sphere) + sizeof(triangle_mesh) + sizeof(instance);
+        materials = sizeof(lambertian) + sizeof(metal);
+    }
+    else if (sc.type == SCENE_BOOK) {
+        objects += n*sizeof(sphere);
+        materials = n*largest;
+    }
+    else {
+        objects += CLUSTER_SIZE*(sizeof(hitable *) + sizeof(sphere)) + sizeof(sphere) + (n-1)*sizeof(instance);
+        materials = CLUSTER_SIZE*largest + sizeof(lambertian);
+    }
+}
+
+// Builds the scene sc describes, seeded by cfg.seed and with cfg's camera
+// settings.  refit_frames > 0 runs the refit benchmark on the book scene
+// before the wide BVHs are collapsed.
+bool scene_build(scene& s, const scene_config& sc, const render_config& cfg, int refit_frames) {
+    int nx = cfg.nx;
+    int ny = cfg.ny;
+    s.config = sc;
+    s.d_cluster = NULL;
+    s.d_blas = NULL;
+    s.d_bvh = NULL;
+    s.accel_bytes = 0;
+    s.num_hitables = scene_num_hitables(sc);
+
+    material_mask_reset();
+
+    // the scene needs a random state of its own to be placed
+    curandState *d_rand_state2;
+    checkCudaErrors(cudaMalloc((void **)&d_rand_state2, 1*sizeof(curandState)));
+    rand_init<<<1,1>>>(d_rand_state2, cfg.seed);
     checkCudaErrors(cudaGetLastError());
     checkCudaErrors(cudaDeviceSynchronize());
 
-    clock_t start, stop;
-    start = clock();
-    // Render our buffer
-    dim3 blocks(nx/tx+1,ny/ty+1);
-    dim3 threads(tx,ty);
-    render_init<<<blocks, threads>>>(nx, ny, d_rand_state);
+    checkCudaErrors(cudaMalloc((void **)&s.d_world, sizeof(hitable *)));
+    checkCudaErrors(cudaMalloc((void **)&s.d_camera, sizeof(camera *)));
+    if (sc.type == SCENE_MESH) {
+        host_mesh h_mesh;
+        auto load_start = std::chrono::steady_clock::now();
+        if (!load_mesh(sc.mesh_file.c_str(), h_mesh)) {
+            checkCudaErrors(cudaFree(d_rand_state2));
+            checkCudaErrors(cudaFree(s.d_world));
+            checkCudaErrors(cudaFree(s.d_camera));
+            return false;
+        }
+        double load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count();
+        std::cerr << "loaded " << h_mesh.num_triangles() << " triangles, " << h_mesh.num_vertices()
+                  << " vertices in " << load_seconds << " seconds.\n";
+        mesh_upload(s.mesh, h_mesh.vx.data(), h_mesh.vy.data(), h_mesh.vz.data(), h_mesh.num_vertices(),
+                    h_mesh.indices.data(), h_mesh.num_triangles());
+        mesh_build_bvh(s.mesh, s.blas, sc.morton64);
+        std::cerr << "mesh LBVH built in " << s.blas.build_ms << " ms.\n";
+
+        // stand the mesh on the ground, centered, about four units high
+        bvh_node root;
+        checkCudaErrors(cudaMemcpy(&root, s.blas.nodes, sizeof(bvh_node), cudaMemcpyDeviceToHost));
+        vec3 lo = root.box.min(), extent = root.box.max() - root.box.min();
+        float scale = 4.0f / ffmax(extent.x(), ffmax(extent.y(), extent.z()));
+        transform placement = make_transform(scale, 0.0f, -scale*vec3(lo.x() + 0.5f*extent.x(), lo.y(), lo.z() + 0.5f*extent.z()));
+
+        checkCudaErrors(cudaMalloc((void **)&s.d_list, s.num_hitables*sizeof(hitable *)));
+        s.cam = config_camera(cfg, mesh_camera());
+        create_mesh_world<<<1,1>>>(s.d_list, s.d_world, s.d_camera, s.mesh, s.blas.nodes, placement, s.cam, nx, ny);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+    else if (sc.type == SCENE_BOOK) {
+        checkCudaErrors(cudaMalloc((void **)&s.d_list, s.num_hitables*sizeof(hitable *)));
+        s.cam = config_camera(cfg, book_camera());
+        create_world<<<1,1>>>(s.d_list, s.d_world, s.d_camera, s.cam, nx, ny, d_rand_state2, sc.diffuse_only);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+    else {
+        // bottom level: one BVH over the cluster, shared by all instances
+        checkCudaErrors(cudaMalloc((void **)&s.d_cluster, CLUSTER_SIZE*sizeof(hitable *)));
+        create_cluster<<<1,1>>>(s.d_cluster, d_rand_state2);
+        checkCudaErrors(cudaGetLastError());
+        lbvh_alloc(s.blas, CLUSTER_SIZE, sc.morton64);
+        lbvh_build(s.blas, s.d_cluster);
+        checkCudaErrors(cudaMalloc((void **)&s.d_blas, sizeof(hitable *)));
+        create_bvh<<<1,1>>>(s.d_blas, s.blas.nodes, s.d_cluster, CLUSTER_SIZE);
+        checkCudaErrors(cudaGetLastError());
+
+        checkCudaErrors(cudaMalloc((void **)&s.d_list, s.num_hitables*sizeof(hitable *)));
+        s.cam = config_camera(cfg, instanced_camera(sc.instance_grid));
+        create_instances<<<1,1>>>(s.d_list, s.d_blas, s.d_world, s.d_camera, s.cam, sc.instance_grid, nx, ny, d_rand_state2);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        size_t unique_bytes = CLUSTER_SIZE*(sizeof(sphere) + sizeof(metal)) + (2*CLUSTER_SIZE-1)*sizeof(bvh_node);
+        size_t instance_bytes = (s.num_hitables-1)*(sizeof(instance) + sizeof(hitable *));
+        std::cerr << s.num_hitables-1 << " instances of a " << CLUSTER_SIZE << " sphere cluster: "
+                  << unique_bytes << " bytes of unique geometry, " << instance_bytes << " bytes of instances.\n";
+    }
+    checkCudaErrors(cudaFree(d_rand_state2));
+    s.materials = scene_material_mask();
+    scene_object_bytes(sc, s.object_bytes, s.material_bytes);
+    mem_alloc(MEM_SCENE, s.object_bytes);
+    mem_alloc(MEM_MATERIALS, s.material_bytes);
+
+    // the refit benchmark moves the spheres of the book scene
+    if (refit_frames > 0 && (sc.type != SCENE_BOOK || sc.accel == ACCEL_LIST))
+        std::cerr << "the refit benchmark needs the book scene and a BVH, skipped.\n";
+
+    // the BVH references the spheres in d_list, the list world stays as is.
+    // The wide BVHs are collapsed from the binary one.
+    if (sc.accel != ACCEL_LIST) {
+        lbvh_alloc(s.accel, s.num_hitables, sc.morton64);
+        lbvh_build(s.accel, s.d_list);
+        std::cerr << "LBVH over " << s.num_hitables << " spheres built in " << s.accel.build_ms << " ms.\n";
+        checkCudaErrors(cudaMalloc((void **)&s.d_bvh, sizeof(hitable *)));
+        if (sc.type == SCENE_BOOK)
+            refit_benchmark(s.accel, s.d_list, refit_frames);
+        // a wide tree too deep for its traversal stack falls back to the binary one
+        if ((sc.accel == ACCEL_BVH4 && !bvh4_build(s.accel4, s.accel, s.d_list)) ||
+            (sc.accel == ACCEL_QBVH4 && !qbvh4_build(s.qaccel4, s.accel, s.d_list))) {
+            std::cerr << "using the LBVH instead.\n";
+            s.config.accel = ACCEL_LBVH;
+        }
+        if (s.config.accel == ACCEL_BVH4) {
+            s.accel_bytes = s.accel4.num_nodes*sizeof(bvh4_node) + s.accel4.num_leaves*sizeof(bvh4_leaf);
+            std::cerr << "collapsed into " << s.accel4.num_nodes << " BVH4 nodes and "
+                      << s.accel4.num_leaves << " leaves.\n";
+            create_bvh4<<<1,1>>>(s.d_bvh, s.accel4.nodes, s.accel4.leaves, s.d_list);
+        }
+        else if (s.config.accel == ACCEL_QBVH4) {
+            s.accel_bytes = s.qaccel4.num_nodes*sizeof(qbvh4_node) + s.qaccel4.num_leaves*sizeof(bvh4_leaf);
+            std::cerr << "collapsed into " << s.qaccel4.num_nodes << " quantized BVH4 nodes and "
+                      << s.qaccel4.num_leaves << " leaves.\n";
+            create_qbvh4<<<1,1>>>(s.d_bvh, s.qaccel4.nodes, s.qaccel4.leaves, s.d_list);
+        }
+        else {
+            s.accel_bytes = (2*s.num_hitables-1)*sizeof(bvh_node);
+            create_bvh<<<1,1>>>(s.d_bvh, s.accel.nodes, s.d_list, s.num_hitables);
+        }
+        std::cerr << "acceleration structure takes " << s.accel_bytes << " bytes.\n";
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+    return true;
+}
+
+void scene_free(scene& s) {
+    checkCudaErrors(cudaDeviceSynchronize());
+    if (s.d_bvh) {
+        free_bvh<<<1,1>>>(s.d_bvh);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaFree(s.d_bvh));
+        if (s.config.accel == ACCEL_BVH4) bvh4_free(s.accel4);
+        if (s.config.accel == ACCEL_QBVH4) qbvh4_free(s.qaccel4);
+        lbvh_free(s.accel);
+    }
+    if (s.config.type == SCENE_BOOK) {
+        free_world<<<1,1>>>(s.d_list, s.d_world, s.d_camera);
+        checkCudaErrors(cudaGetLastError());
+    }
+    else if (s.config.type == SCENE_MESH) {
+        free_mesh_world<<<1,1>>>(s.d_list, s.d_world, s.d_camera);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        mesh_free(s.mesh);
+        lbvh_free(s.blas);
+    }
+    else {
+        free_instanced_world<<<1,1>>>(s.d_cluster, s.d_list, s.num_hitables, s.d_world, s.d_camera);
+        checkCudaErrors(cudaGetLastError());
+        free_bvh<<<1,1>>>(s.d_blas);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaFree(s.d_blas));
+        checkCudaErrors(cudaFree(s.d_cluster));
+        lbvh_free(s.blas);
+    }
+    checkCudaErrors(cudaDeviceSynchronize());
+    checkCudaErrors(cudaFree(s.d_camera));
+    checkCudaErrors(cudaFree(s.d_world));
+    checkCudaErrors(cudaFree(s.d_list));
+    mem_release(MEM_SCENE, s.object_bytes);
+    mem_release(MEM_MATERIALS, s.material_bytes);
+}
+
+// What a run of main with these settings allocates, by category as
+// mem_report counts it, without allocating any of it: the image's buffers,
+// the scene and its acceleration structures, and the scratch of the
+// renderer and of the tracing and profiling tools.  Everything is taken to
+// be allocated at once and the wide BVHs are at their bound, so this is at
+// most a little over the peak the run reports.  Meshes are read to count
+// their triangles; false if that fails.
+bool mem_predict(size_t *bytes, const scene_config& sc, const render_config& cfg, int fb_format,
+                 const render_params& params, bool aov, bool wavefront, bool preview, int num_views,
+                 bool animation, bool profile, bool trace) {
+    size_t num_pixels = size_t(cfg.nx)*cfg.ny;
+    bool single_image = !num_views && !animation;
+    bool progressive = single_image && (preview || cfg.time_budget > 0.0f);
+    for (int c = 0; c < MEM_NUM; c++) bytes[c] = 0;
+    // several views only have images of their own
+    bytes[MEM_FRAMEBUFFER] = (num_views ? num_views : 1)*num_pixels*fb_pixel_bytes(fb_format);
+    if (progressive) bytes[MEM_FRAMEBUFFER] += num_pixels*sizeof(vec3);
+    if (aov) bytes[MEM_AOV] = AOV_PLANES*num_pixels*sizeof(float);
+    if (animation || (single_image && preview))
+        bytes[MEM_PINNED] = FRAME_WRITER_SLOTS*num_pixels*fb_pixel_bytes(fb_format);
+
+    scene_object_bytes(sc, bytes[MEM_SCENE], bytes[MEM_MATERIALS]);
+    if (sc.type == SCENE_MESH) {
+        host_mesh h_mesh;
+        if (!load_mesh(sc.mesh_file.c_str(), h_mesh))
+            return false;
+        bytes[MEM_SCENE] += mesh_bytes(h_mesh.num_vertices(), h_mesh.num_triangles());
+        bytes[MEM_ACCEL] += lbvh_bytes(h_mesh.num_triangles(), sc.morton64);
+    }
+    else if (sc.type == SCENE_INSTANCED) {
+        bytes[MEM_ACCEL] += lbvh_bytes(CLUSTER_SIZE, sc.morton64);
+    }
+    int n = scene_num_hitables(sc);
+    if (sc.accel != ACCEL_LIST) bytes[MEM_ACCEL] += lbvh_bytes(n, sc.morton64);
+    if (sc.accel == ACCEL_BVH4) bytes[MEM_ACCEL] += bvh4_max_bytes(n, sizeof(bvh4_node));
+    if (sc.accel == ACCEL_QBVH4) bytes[MEM_ACCEL] += bvh4_max_bytes(n, sizeof(qbvh4_node));
+
+    bytes[MEM_SCRATCH] = tile_layout_bytes(cfg.nx, cfg.ny, params.tx, params.ty);
+    if (sc.accel == ACCEL_BVH4 || sc.accel == ACCEL_QBVH4) bytes[MEM_SCRATCH] += n*sizeof(float4);
+    if (wavefront && (animation || (single_image && cfg.time_budget <= 0.0f)))
+        bytes[MEM_SCRATCH] += wavefront_bytes(int(num_pixels));
+    if (profile && single_image) bytes[MEM_SCRATCH] += num_pixels*(2*sizeof(unsigned int) + sizeof(unsigned long long));
+    if (trace) bytes[MEM_SCRATCH] += TRACE_MAX_TILES*sizeof(trace_tile);
+    return true;
+}
+
+// -dry-run: prints the prediction next to what the device has free;
+// false if the render would not fit
+bool dry_run(const scene_config& sc, const size_t *bytes) {
+    size_t device = 0;
+    for (int c = 0; c < MEM_NUM; c++)
+        if (c != MEM_PINNED) device += bytes[c];
+    mem_print(std::cerr, "dry run: at most", device, bytes);
+    size_t free_bytes, total_bytes, heap_bytes;
+    checkCudaErrors(cudaMemGetInfo(&free_bytes, &total_bytes));
+    checkCudaErrors(cudaDeviceGetLimit(&heap_bytes, cudaLimitMallocHeapSize));
+    std::cerr << "the device has ";
+    mem_print_bytes(std::cerr, free_bytes);
+    std::cerr << " of ";
+    mem_print_bytes(std::cerr, total_bytes);
+    std::cerr << " free and a heap of ";
+    mem_print_bytes(std::cerr, heap_bytes);
+    std::cerr << " for the scene's objects.\n";
+    size_t objects, materials;
+    scene_object_bytes(sc, objects, materials);
+    if (device > free_bytes)
+        std::cerr << "the render would not fit.\n";
+    if (objects + materials > heap_bytes)
+        std::cerr << "the scene's objects would not fit on the device heap (cudaLimitMallocHeapSize).\n";
+    return device <= free_bytes && objects + materials <= heap_bytes;
+}
+
+const int tile_sizes[][2] = { {8, 4}, {8, 8}, {16, 8}, {16, 16}, {32, 4}, {32, 8} };
+const int num_tile_sizes = sizeof(tile_sizes)/sizeof(tile_sizes[0]);
+
+// renders the frame with every combination of tile size, tile order and
+// in-tile pixel order
+void tile_benchmark(const framebuffer& fb, const render_config& cfg, camera **cam, hitable **world, int materials,
+                    unsigned long long *ray_count) {
+    render_params params = default_render_params();
+    for (int s = 0; s < num_tile_sizes; s++) {
+        params.tx = tile_sizes[s][0];
+        params.ty = tile_sizes[s][1];
+        for (params.tile_order = ORDER_ROW; params.tile_order <= ORDER_HILBERT; params.tile_order++) {
+            for (params.in_tile_order = ORDER_ROW; params.in_tile_order <= ORDER_HILBERT; params.in_tile_order++) {
+                float ms = time_render(params, fb, cfg, cam, world, materials, ray_count);
+                std::cerr << params.tx << "x" << params.ty << " tiles in " << pixel_order_name(params.tile_order)
+                          << " order, pixels in " << pixel_order_name(params.in_tile_order) << " order: " << ms
+                          << " ms, " << *ray_count / (ms*1e3) << " Mrays/s.\n";
+            }
+        }
+    }
+}
+
+// Renders a probe frame at a few samples per pixel with every candidate
+// launch configuration and returns the fastest.
+#define AUTOTUNE_PROBE_SAMPLES 2
+
+render_params autotune(const framebuffer& fb, const render_config& cfg, camera **cam, hitable **world, int materials,
+                       unsigned long long *ray_count) {
+    render_config probe = cfg;
+    probe.ns = AUTOTUNE_PROBE_SAMPLES;
+    const int orders[][2] = { {ORDER_ROW, ORDER_ROW}, {ORDER_HILBERT, ORDER_MORTON} };
+    const int persistent_blocks[] = { 1, 2, 4, 8 };
+    render_params best = default_render_params();
+    float best_ms = FLT_MAX;
+    for (int s = 0; s < num_tile_sizes; s++) {
+        for (int o = 0; o < 2; o++) {
+            for (int b = -1; b < 4; b++) {
+                render_params params;
+                params.tx = tile_sizes[s][0];
+                params.ty = tile_sizes[s][1];
+                params.tile_order = orders[o][0];
+                params.in_tile_order = orders[o][1];
+                params.schedule = b < 0 ? SCHEDULE_STATIC : SCHEDULE_PERSISTENT;
+                params.blocks_per_sm = b < 0 ? 1 : persistent_blocks[b];
+                float ms = time_render(params, fb, probe, cam, world, materials, ray_count);
+                if (ms < best_ms) {
+                    best_ms = ms;
+                    best = params;
+                }
+            }
+        }
+    }
+    std::cerr << "autotune: " << best.tx << "x" << best.ty << " tiles, " << pixel_order_name(best.tile_order) << "/"
+              << pixel_order_name(best.in_tile_order) << " order, " << render_schedule_name(best.schedule)
+              << " schedule with " << best.blocks_per_sm << " blocks per SM, " << best_ms << " ms per probe frame.\n";
+    return best;
+}
+
+// fills fb with 0xff bytes, NaN in the float formats, so that pixels a
+// render leaves out show up as differences instead of keeping the values of
+// the render before
+void fb_poison(const framebuffer& fb) {
+    checkCudaErrors(cudaMemset(fb.data, 0xff, size_t(fb.num_pixels)*fb_pixel_bytes(fb.format)));
+}
+
+// pixels whose stored values differ between a and b
+int count_differences(const framebuffer& a, const framebuffer& b) {
+    size_t pixel_bytes = fb_pixel_bytes(a.format);
+    int differ = 0;
+    for (int i = 0; i < a.num_pixels; i++)
+        if (memcmp((const char *)a.data + i*pixel_bytes, (const char *)b.data + i*pixel_bytes, pixel_bytes))
+            differ++;
+    return differ;
+}
+
+// -check-determinism: renders the image once with params, then with every
+// tile size, the tile and pixel orders and both schedules, split into the
+// four launches of a preview's levels and by the wavefront renderer with
+// and without sorting the rays, and compares each with the first bit for
+// bit.  fb is poisoned before every render.  Rendering the samples in two
+// progressive passes draws the same random numbers but sums them in
+// another order, so that one is only reported.  Returns the number of
+// renders that differ.
+int check_determinism(const render_params& params, int fb_format, const render_config& cfg, camera **cam,
+                      hitable **world, int materials, unsigned long long *ray_count) {
+    int num_pixels = cfg.nx*cfg.ny;
+    aov_buffers no_aov = {};
+    framebuffer reference, fb;
+    framebuffer_alloc(reference, fb_format, num_pixels);
+    framebuffer_alloc(fb, fb_format, num_pixels);
+    tile_layout layout;
+    tile_layout_build(layout, cfg.nx, cfg.ny, params.tx, params.ty, params.tile_order, params.in_tile_order);
+    launch_render(params, layout, reference, cfg, cam, world, materials, 0, no_aov, ray_count);
+    tile_layout_free(layout);
+
+    int renders = 0, failed = 0;
+    for (int s = 0; s < num_tile_sizes; s++) {
+        for (int schedule = SCHEDULE_STATIC; schedule <= SCHEDULE_PERSISTENT; schedule++) {
+            render_params v = params;
+            v.tx = tile_sizes[s][0];
+            v.ty = tile_sizes[s][1];
+            v.tile_order = (s + schedule) % 3;
+            v.in_tile_order = (s + 2*schedule + 1) % 3;
+            v.schedule = schedule;
+            tile_layout_build(layout, cfg.nx, cfg.ny, v.tx, v.ty, v.tile_order, v.in_tile_order);
+            fb_poison(fb);
+            launch_render(v, layout, fb, cfg, cam, world, materials, 0, no_aov, ray_count);
+            tile_layout_free(layout);
+            int differ = count_differences(reference, fb);
+            std::cerr << v.tx << "x" << v.ty << " tiles in " << pixel_order_name(v.tile_order) << "/"
+                      << pixel_order_name(v.in_tile_order) << " order, " << render_schedule_name(v.schedule)
+                      << " schedule: " << (differ ? std::to_string(differ) + " pixels differ" : "identical") << ".\n";
+            renders++;
+            failed += differ > 0;
+        }
+    }
+
+    fb_poison(fb);
+    for (int step = PREVIEW_COARSEST; step >= 1; step /= 2) {
+        tile_layout_build_level(layout, cfg.nx, cfg.ny, params.tx, params.ty, params.tile_order, params.in_tile_order,
+                                step, step == PREVIEW_COARSEST ? 0 : 2*step);
+        launch_render(params, layout, fb, cfg, cam, world, materials, 0, no_aov, ray_count);
+        tile_layout_free(layout);
+    }
+    int differ = count_differences(reference, fb);
+    std::cerr << "pixels split into " << PREVIEW_COARSEST << "th, 4th, 2nd and the rest: "
+              << (differ ? std::to_string(differ) + " pixels differ" : "identical") << ".\n";
+    renders++;
+    failed += differ > 0;
+
+    for (int sort_rays = 0; sort_rays <= 1; sort_rays++) {
+        fb_poison(fb);
+        render_wavefront(fb, cfg.nx, cfg.ny, cfg.ns, cfg.max_depth, params.tx, params.ty, cam, world, cfg.seed, 0,
+                         sort_rays, ray_count);
+        differ = count_differences(reference, fb);
+        std::cerr << (sort_rays ? "wavefront, rays sorted: " : "wavefront: ")
+                  << (differ ? std::to_string(differ) + " pixels differ" : "identical") << ".\n";
+        renders++;
+        failed += differ > 0;
+    }
+
+    if (cfg.ns > 1) {
+        render_config half = cfg;
+        half.ns = cfg.ns / 2;
+        framebuffer_alloc_accum(fb);
+        tile_layout_build(layout, cfg.nx, cfg.ny, params.tx, params.ty, params.tile_order, params.in_tile_order);
+        fb_poison(fb);
+        launch_render(params, layout, fb, half, cam, world, materials, 0, no_aov, ray_count);
+        fb.accum_samples = half.ns;
+        half.ns = cfg.ns - half.ns;
+        launch_render(params, layout, fb, half, cam, world, materials, fb.accum_samples, no_aov, ray_count);
+        tile_layout_free(layout);
+        std::cerr << "samples in two passes: " << count_differences(reference, fb)
+                  << " pixels differ by rounding.\n";
+    }
+
+    if (failed)
+        std::cerr << "determinism: " << failed << " of " << renders << " renders differ from the first.\n";
+    else
+        std::cerr << "determinism: all " << renders << " renders identical to the first.\n";
+    framebuffer_free(reference);
+    framebuffer_free(fb);
+    return failed;
+}
+
+// Renders frames 0 to num_frames-1 along the camera path into
+// <prefix>NNNN.ppm.  The scene is built once, each frame only moves the
+// camera, and the writer thread encodes a frame while the next renders.
+// Frame f renders samples f*ns on, so the noise is fresh every frame.
+void render_animation(const render_params& params, const tile_layout& layout, const framebuffer& fb,
+                      const render_config& cfg, const std::vector<camera_key>& path, int num_frames,
+                      const char *prefix, camera_params scene_cam, camera **cam, hitable **world, int materials,
+                      bool wavefront, bool sort_rays, unsigned long long *ray_count) {
+    frame_writer writer;
+    frame_writer_start(writer, fb.format, cfg.nx, cfg.ny);
+    aov_buffers no_aov = {};
+    double render_seconds = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < num_frames; f++) {
+        auto frame_start = std::chrono::steady_clock::now();
+        set_camera<<<1,1>>>(cam, camera_path_at(path, float(f), scene_cam), cfg.nx, cfg.ny);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        if (wavefront)
+            render_wavefront(fb, cfg.nx, cfg.ny, cfg.ns, cfg.max_depth, params.tx, params.ty, cam, world, cfg.seed,
+                             f*cfg.ns, sort_rays, ray_count);
+        else
+            launch_render(params, layout, fb, cfg, cam, world, materials, f*cfg.ns, no_aov, ray_count);
+        render_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count();
+        char name[32];
+        snprintf(name, sizeof(name), "%04d.ppm", f);
+        frame_writer_submit(writer, fb, std::string(prefix) + name);
+    }
+    frame_writer_finish(writer);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << num_frames << " frames in " << seconds << " seconds (" << num_frames / seconds << " frames/s), "
+              << render_seconds << " of them rendering, " << writer.write_seconds << " writing in the background, "
+              << *ray_count / seconds / 1e6 << " Mrays/s.\n";
+}
+
+// Renders the scene once per camera in views into <prefix>NNNN.ppm, all
+// in the same launch, with tiles of all views interleaved.
+void render_views(const render_params& params, const tile_layout& layout, int fb_format, const render_config& cfg,
+                  const std::vector<camera_params>& views, const char *prefix, hitable **world, int materials,
+                  unsigned long long *ray_count) {
+    int num_views = int(views.size());
+    int num_pixels = cfg.nx*cfg.ny;
+    size_t view_pixels = size_t(num_views)*num_pixels;
+    camera_params *d_params;
+    checkCudaErrors(cudaMallocManaged((void **)&d_params, num_views*sizeof(camera_params)));
+    for (int v = 0; v < num_views; v++)
+        d_params[v] = views[v];
+    camera **d_views;
+    checkCudaErrors(cudaMalloc((void **)&d_views, num_views*sizeof(camera *)));
+    create_views<<<1,1>>>(d_views, d_params, num_views, cfg.nx, cfg.ny);
     checkCudaErrors(cudaGetLastError());
+    framebuffer fb;
+    framebuffer_alloc(fb, fb_format, int(view_pixels));
     checkCudaErrors(cudaDeviceSynchronize());
-    render<<<blocks, threads>>>(fb, nx, ny,  ns, d_camera, d_world, d_rand_state);
+
+    aov_buffers no_aov = {};
+    auto start = std::chrono::steady_clock::now();
+    launch_render(params, layout, fb, cfg, d_views, world, materials, 0, no_aov, ray_count, num_views);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << num_views << " views in " << seconds << " seconds, " << *ray_count / seconds / 1e6 << " Mrays/s.\n";
+
+    for (int v = 0; v < num_views; v++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%04d.ppm", v);
+        std::string path = std::string(prefix) + name;
+        std::ofstream out(path.c_str());
+        write_ppm(out, fb_view(fb, v, num_pixels), cfg.nx, cfg.ny);
+        if (!out)
+            std::cerr << "could not write " << path << "\n";
+    }
+
+    free_views<<<1,1>>>(d_views, num_views);
     checkCudaErrors(cudaGetLastError());
     checkCudaErrors(cudaDeviceSynchronize());
+    checkCudaErrors(cudaFree(d_views));
+    checkCudaErrors(cudaFree(d_params));
+    framebuffer_free(fb);
+}
+
+// -serve: renders the jobs of a render_server (see render_server.h) one at a
+// time.  The SCENE_CACHE_SIZE most recently used scenes stay built, with
+// their acceleration structures, so a job on one of them only sets the
+// camera.  Launch parameters are the tuned ones of the scene's class if
+// cached, default_params otherwise.
+#define SCENE_CACHE_SIZE 4
+#define RESULT_CACHE_BYTES (size_t(1) << 30)
+
+int serve(const char *socket_path, const render_params& default_params) {
+    render_server server;
+    if (!server_open(server, socket_path, RESULT_CACHE_BYTES))
+        return 1;
+    std::cerr << "serving on " << socket_path << ".\n";
+    std::list<std::pair<std::string, scene> > scenes;  // most recently used first
+    unsigned long long *ray_count;
+    checkCudaErrors(cudaMallocManaged((void **)&ray_count, sizeof(unsigned long long)));
+    render_job *job;
+    while (server_next_job(server, job)) {
+        const render_request& req = job->request;
+        const render_config& cfg = req.cfg;
+        std::string key = scene_key(req.scene, cfg.seed);
+        auto cached = scenes.begin();
+        while (cached != scenes.end() && cached->first != key)
+            ++cached;
+        if (cached != scenes.end()) {
+            scenes.splice(scenes.begin(), scenes, cached);
+        }
+        else {
+            // built with the scene's own camera, jobs apply theirs on top
+            render_config base = cfg;
+            base.cam_set = 0;
+            scenes.push_front(std::make_pair(key, scene()));
+            if (!scene_build(scenes.front().second, req.scene, base, 0)) {
+                scenes.pop_front();
+                server_complete(server, job, "error: could not build the scene\n", false);
+                continue;
+            }
+            if (scenes.size() > SCENE_CACHE_SIZE) {
+                scene_free(scenes.back().second);
+                scenes.pop_back();
+            }
+        }
+        scene& world = scenes.front().second;
+
+        render_params params = default_params;
+        autotune_load(AUTOTUNE_CACHE, autotune_key(scene_class(req.scene)), params);
+        int num_pixels = cfg.nx*cfg.ny;
+        set_camera<<<1,1>>>(world.d_camera, config_camera(cfg, world.cam), cfg.nx, cfg.ny);
+        checkCudaErrors(cudaGetLastError());
+        framebuffer fb;
+        framebuffer_alloc(fb, req.fb_format, num_pixels);
+        checkCudaErrors(cudaDeviceSynchronize());
+        tile_layout layout;
+        tile_layout_build(layout, cfg.nx, cfg.ny, params.tx, params.ty, params.tile_order, params.in_tile_order);
+        aov_buffers no_aov = {};
+        *ray_count = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::string comment;
+        if (cfg.time_budget > 0.0f) {
+            framebuffer_alloc_accum(fb);
+            comment = std::to_string(render_progressive(params, layout, fb, cfg, world.d_camera, scene_world(world),
+                                                        world.materials, ray_count)) + " samples per pixel";
+        }
+        else {
+            launch_render(params, layout, fb, cfg, world.d_camera, scene_world(world), world.materials, 0, no_aov, ray_count);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "job " << job->seq << " (" << req.key << ") took " << seconds << " seconds, "
+                  << *ray_count / seconds / 1e6 << " Mrays/s.\n";
+        std::ostringstream image;
+        write_ppm(image, fb, cfg.nx, cfg.ny, comment);
+        tile_layout_free(layout);
+        framebuffer_free(fb);
+        // what a time budget reaches depends on the load, so those are not reused
+        server_complete(server, job, image.str(), cfg.time_budget == 0.0f);
+    }
+    server_close(server);
+    mem_report(std::cerr);
+    for (auto it = scenes.begin(); it != scenes.end(); ++it)
+        scene_free(it->second);
+    checkCudaErrors(cudaFree(ray_count));
+    cudaDeviceReset();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // -aov <file.exr> additionally writes the linear color, albedo, normal, depth and ids
+    // -accel list|lbvh|bvh4|qbvh4 selects the acceleration structure, -morton64 the LBVH code width
+    // -lbvh-bench <n> only times LBVH builds over n random spheres
+    // -refit-bench <frames> animates the spheres, refitting the LBVH every frame, before rendering
+    // -scene book|diffuse|instanced picks the scene (diffuse is the book's with lambertians only), -instances <grid> the size of the instanced one
+    // -mesh <file.ply|file.obj> renders a triangle mesh instead
+    // -wavefront traces one bounce per launch, -sort-rays also sorts secondary rays between bounces
+    // -tile <w>x<h> sets the block size, -tile-order and -pixel-order row|morton|hilbert the order
+    // of the tiles and of the pixels within a tile, -tile-bench times all combinations
+    // -schedule static|persistent [-blocks-per-sm n] picks how tiles are handed to blocks
+    // -autotune probes all launch parameters and caches the fastest; without explicit launch
+    // options a cached result for this device and scene is used
+    // -config <file> reads key=value settings (see config.h), -set key=value gives one
+    // -fb-format float|half|rgbe|rgb8 sets how the image is stored on the device
+    // -camera-path <file> renders an animation along keyframes (see animation.h) to <prefix>NNNN.ppm,
+    // -frames n (default: up to the last keyframe) and -frame-prefix <prefix> (default "frame")
+    // -views <file> (camera settings per line, see config.h) or -orbit n render several views of the
+    // scene in one launch to <prefix>NNNN.ppm, the prefix again set by -frame-prefix (default "view")
+    // -serve <socket> runs as a render daemon (see render_server.h), the launch options are its defaults
+    // -trace <file.json> writes a Chrome trace of the tiles per SM and the host phases (trace.h) in builds
+    // with -DRT_TRACE
+    // -perf reports the CPU's hardware counters for the host stages: scene build, image output and the
+    // frame writer thread (perf_counters.h)
+    // -profile <prefix> writes heatmaps of bounces, primitive tests and cycles per pixel and histograms of
+    // path cost (profile.h) in builds with -DRT_PROFILE
+    // -preview <prefix> first renders a coarse to fine preview to <prefix>8.ppm ... <prefix>1.ppm, whose
+    // sample the full render keeps
+    // -check-determinism renders the image with other launch parameters and splits and compares the results
+    // bit for bit, exiting with 1 if any differ
+    // -dry-run only predicts the device memory the render takes by category (mem_usage.h) and whether it
+    // fits, runs report the peak they reached
+    const char *aov_file = NULL;
+    scene_config sc = default_scene_config();
+    int refit_frames = 0;
+    bool wavefront = false;
+    bool sort_rays = false;
+    render_params params = default_render_params();
+    bool params_given = false;
+    bool tile_bench = false;
+    bool tune = false;
+    render_config cfg = default_render_config();
+    int fb_format = FB_FLOAT;
+    std::vector<camera_key> camera_path;
+    int num_frames = 0;
+    const char *frame_prefix = NULL;
+    std::vector<render_config> view_configs;
+    int orbit = 0;
+    const char *serve_path = NULL;
+    const char *preview_prefix = NULL;
+    const char *profile_prefix = NULL;
+    const char *trace_file = NULL;
+    bool dry = false;
+    bool check = false;
+    int lbvh_spheres;
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-aov") && a+1 < argc) aov_file = argv[++a];
+        else if (!strcmp(argv[a], "-accel") && a+1 < argc && scene_config_set(sc, "accel", argv[a+1])) a++;
+        else if (!strcmp(argv[a], "-morton64")) sc.morton64 = true;
+        else if (!strcmp(argv[a], "-scene") && a+1 < argc && scene_config_set(sc, "scene", argv[a+1])) a++;
+        else if (!strcmp(argv[a], "-instances") && a+1 < argc && scene_config_set(sc, "instances", argv[a+1])) a++;
+        else if (!strcmp(argv[a], "-mesh") && a+1 < argc) { sc.mesh_file = argv[++a]; sc.type = SCENE_MESH; }
+        else if (!strcmp(argv[a], "-refit-bench") && a+1 < argc) refit_frames = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "-wavefront")) wavefront = true;
+        else if (!strcmp(argv[a], "-sort-rays")) wavefront = sort_rays = true;
+        else if (!strcmp(argv[a], "-tile") && a+1 < argc && parse_tile_size(argv[a+1], params.tx, params.ty)) {
+            a++;
+            params_given = true;
+        }
+        else if (!strcmp(argv[a], "-tile-order") && a+1 < argc && parse_pixel_order(argv[a+1]) >= 0) {
+            params.tile_order = parse_pixel_order(argv[++a]);
+            params_given = true;
+        }
+        else if (!strcmp(argv[a], "-pixel-order") && a+1 < argc && parse_pixel_order(argv[a+1]) >= 0) {
+            params.in_tile_order = parse_pixel_order(argv[++a]);
+            params_given = true;
+        }
+        else if (!strcmp(argv[a], "-schedule") && a+1 < argc && parse_schedule(argv[a+1]) >= 0) {
+            params.schedule = parse_schedule(argv[++a]);
+            params_given = true;
+        }
+        else if (!strcmp(argv[a], "-blocks-per-sm") && a+1 < argc &&
+                 parse_int(argv[a+1], params.blocks_per_sm, 1, RENDER_MAX_BLOCKS_PER_SM)) {
+            a++;
+            params_given = true;
+        }
+        else if (!strcmp(argv[a], "-tile-bench")) tile_bench = true;
+        else if (!strcmp(argv[a], "-autotune")) tune = true;
+        else if (!strcmp(argv[a], "-config") && a+1 < argc) {
+            if (!config_load(cfg, argv[++a]))
+                return 1;
+        }
+        else if (!strcmp(argv[a], "-set") && a+1 < argc) {
+            if (!config_set(cfg, argv[++a])) {
+                std::cerr << "bad setting '" << argv[a] << "'\n";
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[a], "-fb-format") && a+1 < argc && parse_fb_format(argv[a+1]) >= 0)
+            fb_format = parse_fb_format(argv[++a]);
+        else if (!strcmp(argv[a], "-camera-path") && a+1 < argc) {
+            if (!camera_path_load(argv[++a], camera_path))
+                return 1;
+        }
+        else if (!strcmp(argv[a], "-views") && a+1 < argc) {
+            if (!config_load_views(argv[++a], view_configs))
+                return 1;
+        }
+        else if (!strcmp(argv[a], "-orbit") && a+1 < argc && parse_int(argv[a+1], orbit, 1, CONFIG_MAX_VIEWS)) a++;
+        else if (!strcmp(argv[a], "-serve") && a+1 < argc) serve_path = argv[++a];
+        else if (!strcmp(argv[a], "-preview") && a+1 < argc) preview_prefix = argv[++a];
+        else if (!strcmp(argv[a], "-profile") && a+1 < argc) profile_prefix = argv[++a];
+        else if (!strcmp(argv[a], "-trace") && a+1 < argc) trace_file = argv[++a];
+        else if (!strcmp(argv[a], "-perf")) perf_enabled() = true;
+        else if (!strcmp(argv[a], "-dry-run")) dry = true;
+        else if (!strcmp(argv[a], "-check-determinism")) check = true;
+        else if (!strcmp(argv[a], "-frames") && a+1 < argc) num_frames = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "-frame-prefix") && a+1 < argc) frame_prefix = argv[++a];
+        else if (!strcmp(argv[a], "-lbvh-bench") && a+1 < argc &&
+                 parse_int(argv[a+1], lbvh_spheres, 1, LBVH_BENCH_MAX_SPHERES)) {
+            lbvh_benchmark(lbvh_spheres);
+            return 0;
+        }
+        else {
+            std::cerr << "usage: " << argv[0] << " [-aov file.exr] [-accel list|lbvh|bvh4|qbvh4] [-morton64] [-lbvh-bench n] [-refit-bench frames]"
+                      << " [-scene book|diffuse|instanced] [-instances grid] [-mesh file] [-wavefront] [-sort-rays]"
+                      << " [-tile wxh] [-tile-order row|morton|hilbert] [-pixel-order row|morton|hilbert] [-tile-bench]"
+                      << " [-schedule static|persistent] [-blocks-per-sm n] [-autotune]"
+                      << " [-config file] [-set key=value] [-fb-format float|half|rgbe|rgb8]"
+                      << " [-camera-path file [-frames n] [-frame-prefix prefix]] [-views file] [-orbit n] [-serve socket] [-preview prefix] [-profile prefix] [-trace file.json] [-perf] [-dry-run] [-check-determinism] > out.ppm\n";
+            return 1;
+        }
+    }
+
+    if (!render_params_valid(params)) {
+        std::cerr << "tiles must have between 1 and " << RENDER_MAX_TILE_PIXELS << " pixels\n";
+        return 1;
+    }
+    if (serve_path)
+        return serve(serve_path, params);
+    int num_views = orbit + int(view_configs.size());
+    if (num_views && !camera_path.empty()) {
+        std::cerr << "-views and -orbit can't be combined with -camera-path\n";
+        return 1;
+    }
+    // the views share one framebuffer and one range of random streams
+    if (num_views > CONFIG_MAX_VIEWS || size_t(num_views)*cfg.nx*cfg.ny > INT_MAX) {
+        std::cerr << "too many views of " << cfg.nx << "x" << cfg.ny << " pixels\n";
+        return 1;
+    }
+    if (dry) {
+        size_t bytes[MEM_NUM];
+        if (!mem_predict(bytes, sc, cfg, fb_format, params, aov_file, wavefront, preview_prefix, num_views,
+                         !camera_path.empty(), profile_prefix, trace_file))
+            return 1;
+        return dry_run(sc, bytes) ? 0 : 1;
+    }
+
+    int nx = cfg.nx;
+    int ny = cfg.ny;
+    int ns = cfg.ns;
+    if (trace_file && !trace_start())
+        std::cerr << "-trace needs a build with -DRT_TRACE.\n";
+
+    int num_pixels = nx*ny;
+    size_t fb_size = num_pixels*fb_pixel_bytes(fb_format);
+
+    // allocate FB; several views allocate theirs in render_views and only
+    // need this one for tuning
+    framebuffer fb = {};
+    if (!num_views || tile_bench || tune)
+        framebuffer_alloc(fb, fb_format, num_pixels);
+
+    // allocate AOVs, AOV_PLANES planar float channels
+    aov_buffers aov = {};
+    if (aov_file) {
+        float *planes;
+        checkCudaErrors(cudaMallocManaged((void **)&planes, AOV_PLANES*num_pixels*sizeof(float)));
+        mem_alloc(MEM_AOV, AOV_PLANES*num_pixels*sizeof(float));
+        aov.albedo  = planes;
+        aov.normal  = planes + 3*num_pixels;
+        aov.depth   = planes + 6*num_pixels;
+        aov.prim_id = planes + 7*num_pixels;
+        aov.mat_id  = planes + 8*num_pixels;
+        aov.color   = planes + 9*num_pixels;
+    }
+
+    // make our world of hitables & the camera
+    scene world;
+    perf_counters perf;
+    if (perf_enabled()) {
+        perf_open(perf);
+        perf_start(perf);
+    }
+    int phase = trace_begin("scene build");
+    if (!scene_build(world, sc, cfg, refit_frames))
+        return 1;
+    trace_end(phase);
+    if (perf_enabled()) {
+        perf_stop(perf);
+        perf_report(std::cerr, perf, "scene build");
+    }
+
+    unsigned long long *ray_count;
+    checkCudaErrors(cudaMallocManaged((void **)&ray_count, sizeof(unsigned long long)));
+    *ray_count = 0;
+
+    if (tile_bench)
+        tile_benchmark(fb, cfg, world.d_camera, scene_world(world), world.materials, ray_count);
+
+    // tuned launch parameters depend on the device and on the kind of scene
+    std::string tune_key = autotune_key(scene_class(sc));
+    if (tune) {
+        params = autotune(fb, cfg, world.d_camera, scene_world(world), world.materials, ray_count);
+        if (!autotune_store(AUTOTUNE_CACHE, tune_key, params))
+            std::cerr << "could not write " << AUTOTUNE_CACHE << "\n";
+    }
+    else if (!params_given && autotune_load(AUTOTUNE_CACHE, tune_key, params)) {
+        std::cerr << "using tuned launch parameters for " << tune_key << ".\n";
+    }
+    if (num_views)
+        framebuffer_free(fb);
+    int tx = params.tx;
+    int ty = params.ty;
+    if (check) {
+        int failed = check_determinism(params, fb_format, cfg, world.d_camera, scene_world(world), world.materials, ray_count);
+        scene_free(world);
+        framebuffer_free(fb);
+        checkCudaErrors(cudaFree(ray_count));
+        cudaDeviceReset();
+        return failed ? 1 : 0;
+    }
+
+    std::cerr << "Rendering a " << nx << "x" << ny << " image with " << ns << " samples per pixel, max depth "
+              << cfg.max_depth << ", seed " << cfg.seed << ", ";
+    std::cerr << "in " << tx << "x" << ty << " blocks, tiles in " << pixel_order_name(params.tile_order)
+              << " order, pixels in " << pixel_order_name(params.in_tile_order) << " order, "
+              << render_schedule_name(params.schedule) << " schedule.\n";
+    std::cerr << "framebuffer " << fb_format_name(fb_format) << ", " << fb_size << " bytes ("
+              << fb_pixel_bytes(fb_format) << " per pixel); sphere " << sizeof(sphere) << " bytes, lambertian " << sizeof(lambertian)
+              << ", metal " << sizeof(metal) << ".\n";
+
+    *ray_count = 0;
+    tile_layout layout;
+    tile_layout_build(layout, nx, ny, tx, ty, params.tile_order, params.in_tile_order);
+
+    clock_t start, stop;
+    start = clock();
+    phase = trace_begin("render");
+    // Render our buffer
+    std::vector<camera_params> views = orbit > 0 ? orbit_views(world.cam, orbit) : std::vector<camera_params>();
+    for (size_t v = 0; v < view_configs.size(); v++)
+        views.push_back(config_camera(view_configs[v], world.cam));
+    bool single_image = views.empty() && camera_path.empty();
+    profile_counters profile = {};
+    if (profile_prefix && !single_image)
+        std::cerr << "-profile only profiles single images.\n";
+    else if (profile_prefix && !profile_alloc(profile, num_pixels))
+        std::cerr << "-profile needs a build with -DRT_PROFILE.\n";
+    else if (profile_prefix && wavefront)
+        std::cerr << "the wavefront renderer is not profiled.\n";
+    if (preview_prefix && single_image) {
+        // the preview takes the first sample of every pixel
+        if (aov_file) std::cerr << "AOVs are not written after a preview.\n";
+        framebuffer_alloc_accum(fb);
+        render_preview(params, fb, cfg, world.d_camera, scene_world(world), world.materials, preview_prefix, ray_count);
+        ns = --cfg.ns;
+    }
+    if (!views.empty()) {
+        if (aov_file) std::cerr << "AOVs are not written for several views.\n";
+        if (wavefront) std::cerr << "several views are rendered by the megakernel.\n";
+        render_views(params, layout, fb_format, cfg, views, frame_prefix ? frame_prefix : "view", scene_world(world),
+                     world.materials, ray_count);
+    }
+    else if (!camera_path.empty()) {
+        if (aov_file) std::cerr << "AOVs are not written for animations.\n";
+        if (num_frames <= 0) num_frames = int(camera_path.back().frame) + 1;
+        render_animation(params, layout, fb, cfg, camera_path, num_frames, frame_prefix ? frame_prefix : "frame",
+                         world.cam, world.d_camera, scene_world(world), world.materials, wavefront, sort_rays, ray_count);
+    }
+    else if (cfg.time_budget > 0.0f) {
+        if (aov_file) std::cerr << "AOVs are not written by time budgeted renders.\n";
+        if (wavefront) std::cerr << "time budgeted renders use the megakernel.\n";
+        if (!fb.accum) framebuffer_alloc_accum(fb);
+        render_progressive(params, layout, fb, cfg, world.d_camera, scene_world(world), world.materials, ray_count);
+    }
+    else if (wavefront && ns > 0) {
+        if (aov_file) std::cerr << "AOVs are not written by the wavefront renderer.\n";
+        render_wavefront(fb, nx, ny, ns, cfg.max_depth, tx, ty, world.d_camera, scene_world(world), cfg.seed,
+                         fb.accum_samples, sort_rays, ray_count);
+        fb.accum_samples += ns;
+    }
+    else if (ns > 0) {
+        launch_render(params, layout, fb, cfg, world.d_camera, scene_world(world), world.materials, fb.accum_samples, aov,
+                      ray_count);
+        fb.accum_samples += ns;
+    }
     stop = clock();
+    trace_end(phase);
     double timer_seconds = ((double)(stop - start)) / CLOCKS_PER_SEC;
-    std::cerr << "took " << timer_seconds << " seconds.\n";
+    if (single_image)
+        std::cerr << "took " << timer_seconds << " seconds, " << *ray_count / timer_seconds / 1e6 << " Mrays/s.\n";
 
-    // Output FB as Image
-    std::cout << "P3\n" << nx << " " << ny << "\n255\n";
-    for (int j = ny-1; j >= 0; j--) {
-        for (int i = 0; i < nx; i++) {
-            size_t pixel_index = j*nx + i;
-            int ir = int(255.99*fb[pixel_index].r());
-            int ig = int(255.99*fb[pixel_index].g());
-            int ib = int(255.99*fb[pixel_index].b());
-            std::cout << ir << " " << ig << " " << ib << "\n";
-        }
+    // Output FB as Image, animations and views have written theirs
+    phase = trace_begin("write image");
+    if (perf_enabled()) {
+        perf_close(perf);
+        perf_open(perf);
+        perf_start(perf);
+    }
+    if (single_image && fb.accum)
+        write_ppm(std::cout, fb, nx, ny, std::to_string(fb.accum_samples) + " samples per pixel");
+    else if (single_image)
+        write_ppm(std::cout, fb, nx, ny);
+    if (aov_file && !wavefront && single_image && !fb.accum) {
+        if (!write_aov_exr(aov_file, aov, nx, ny))
+            std::cerr << "could not write " << aov_file << "\n";
+    }
+    if (profile.num_pixels) {
+        profile_write(profile, nx, ny, fb.accum ? fb.accum_samples : ns, profile_prefix);
+        profile_free(profile);
     }
+    trace_end(phase);
+    if (perf_enabled()) {
+        perf_stop(perf);
+        if (single_image) perf_report(std::cerr, perf, "write image", num_pixels, "pixel");
+        perf_close(perf);
+    }
+    if (trace_file)
+        trace_write(trace_file);
+    mem_report(std::cerr);
 
     // clean up
-    checkCudaErrors(cudaDeviceSynchronize());
-    free_world<<<1,1>>>(d_list,d_world,d_camera);
-    checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaFree(d_camera));
-    checkCudaErrors(cudaFree(d_world));
-    checkCudaErrors(cudaFree(d_list));
-    checkCudaErrors(cudaFree(d_rand_state));
-    checkCudaErrors(cudaFree(d_rand_state2));
-    checkCudaErrors(cudaFree(fb));
+    scene_free(world);
+    framebuffer_free(fb);
+    checkCudaErrors(cudaFree(ray_count));
+    tile_layout_free(layout);
+    if (aov.albedo) checkCudaErrors(cudaFree(aov.albedo));
 
     cudaDeviceReset();
 }
@@ -5,15 +5,16 @@ struct hit_record;
 
 #include "ray.h"
 #include "hitable.h"
+#include "sample_rng.h"
 
 
-__device__ float schlick(float cosine, float ref_idx) {
+__host__ __device__ inline float schlick(float cosine, float ref_idx) {
     float r0 = (1.0f-ref_idx) / (1.0f+ref_idx);
     r0 = r0*r0;
     return r0 + (1.0f-r0)*pow((1.0f - cosine),5.0f);
 }
 
-__device__ bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted) {
+__host__ __device__ inline bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted) {
     vec3 uv = unit_vector(v);
     float dt = dot(uv, n);
     float discriminant = 1.0f - ni_over_nt*ni_over_nt*(1-dt*dt);
@@ -27,7 +28,7 @@ __device__ bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& re
 
 #define RANDVEC3 vec3(curand_uniform(local_rand_state),curand_uniform(local_rand_state),curand_uniform(local_rand_state))
 
-__device__ vec3 random_in_unit_sphere(curandState *local_rand_state) {
+__device__ vec3 random_in_unit_sphere(sample_rng *local_rand_state) {
     vec3 p;
     do {
         p = 2.0f*RANDVEC3 - vec3(1,1,1);
@@ -35,49 +36,84 @@ __device__ vec3 random_in_unit_sphere(curandState *local_rand_state) {
     return p;
 }
 
-__device__ vec3 reflect(const vec3& v, const vec3& n) {
+__host__ __device__ inline vec3 reflect(const vec3& v, const vec3& n) {
      return v - 2.0f*dot(v,n)*n;
 }
 
+// -DPACKED_ALBEDO stores albedos with 8 bits per channel; they convert to
+// and from vec3, so scatter() still works in float.
+#ifdef PACKED_ALBEDO
+struct albedo_t {
+    unsigned int rgb;
+    __host__ __device__ albedo_t(const vec3& c) {
+        rgb = 0;
+        for (int k = 0; k < 3; k++)
+            rgb |= (unsigned int)(255.0f*fminf(fmaxf(c[k], 0.0f), 1.0f) + 0.5f) << (8*k);
+    }
+    __host__ __device__ operator vec3() const {
+        return vec3((rgb & 0xff)/255.0f, (rgb >> 8 & 0xff)/255.0f, (rgb >> 16 & 0xff)/255.0f);
+    }
+};
+#else
+typedef vec3 albedo_t;
+#endif
+
+// material ids written to the AOV buffers
+enum material_kind { MAT_LAMBERTIAN = 0, MAT_METAL = 1, MAT_DIELECTRIC = 2 };
+
+// one bit per kind of material constructed since material_mask_reset(), read
+// back by the host after building a scene to pick kernels for its materials
+__device__ int material_kinds_created = 0;
+
 class material  {
     public:
-        __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState *local_rand_state) const = 0;
+        __device__ material(int k) : kind(k) { material_kinds_created |= 1 << k; }
+        __device__ virtual vec3 aov_albedo() const = 0;
+        __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sample_rng *local_rand_state) const = 0;
+
+        int kind;
 };
 
 class lambertian : public material {
     public:
-        __device__ lambertian(const vec3& a) : albedo(a) {}
-        __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState *local_rand_state) const  {
+        enum { KIND = MAT_LAMBERTIAN };
+        __device__ lambertian(const vec3& a) : material(MAT_LAMBERTIAN), albedo(a) {}
+        __device__ virtual vec3 aov_albedo() const { return albedo; }
+        __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sample_rng *local_rand_state) const  {
              vec3 target = rec.p + rec.normal + random_in_unit_sphere(local_rand_state);
              scattered = ray(rec.p, target-rec.p);
              attenuation = albedo;
              return true;
         }
 
-        vec3 albedo;
+        albedo_t albedo;
 };
 
 class metal : public material {
     public:
-        __device__ metal(const vec3& a, float f) : albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
-        __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState *local_rand_state) const  {
+        enum { KIND = MAT_METAL };
+        __device__ metal(const vec3& a, float f) : material(MAT_METAL), albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
+        __device__ virtual vec3 aov_albedo() const { return albedo; }
+        __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sample_rng *local_rand_state) const  {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
             scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(local_rand_state));
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0.0f);
         }
-        vec3 albedo;
+        albedo_t albedo;
         float fuzz;
 };
 
 class dielectric : public material {
 public:
-    __device__ dielectric(float ri) : ref_idx(ri) {}
+    enum { KIND = MAT_DIELECTRIC };
+    __device__ dielectric(float ri) : material(MAT_DIELECTRIC), ref_idx(ri) {}
+    __device__ virtual vec3 aov_albedo() const { return vec3(1.0, 1.0, 1.0); }
     __device__ virtual bool scatter(const ray& r_in,
                          const hit_record& rec,
                          vec3& attenuation,
                          ray& scattered,
-                         curandState *local_rand_state) const  {
+                         sample_rng *local_rand_state) const  {
         vec3 outward_normal;
         vec3 reflected = reflect(r_in.direction(), rec.normal);
         float ni_over_nt;
@@ -0,0 +1,55 @@
+#ifndef MATERIALSETH
+#define MATERIALSETH
+
+#include "check_cuda.h"
+#include "material.h"
+
+// A compile-time list of the material classes a kernel can meet.
+// material_set<...>::scatter tests the kind of the material against each
+// listed class in turn and calls that class's scatter by its qualified name,
+// so the call is not virtual and can be inlined, and the code of materials
+// that are not listed is never compiled into the kernel.  The last class is
+// called without a test: a kernel is only launched for scenes whose
+// materials are all in its set.
+template <typename... M> struct material_set;
+
+template <typename M>
+struct material_set<M> {
+    static const int mask = 1 << M::KIND;
+    __device__ static bool scatter(const material *m, const ray& r_in, const hit_record& rec, vec3& attenuation,
+                                   ray& scattered, sample_rng *local_rand_state) {
+        return static_cast<const M *>(m)->M::scatter(r_in, rec, attenuation, scattered, local_rand_state);
+    }
+};
+
+template <typename M, typename N, typename... Rest>
+struct material_set<M, N, Rest...> {
+    static const int mask = (1 << M::KIND) | material_set<N, Rest...>::mask;
+    __device__ static bool scatter(const material *m, const ray& r_in, const hit_record& rec, vec3& attenuation,
+                                   ray& scattered, sample_rng *local_rand_state) {
+        if (m->kind == M::KIND)
+            return static_cast<const M *>(m)->M::scatter(r_in, rec, attenuation, scattered, local_rand_state);
+        return material_set<N, Rest...>::scatter(m, r_in, rec, attenuation, scattered, local_rand_state);
+    }
+};
+
+typedef material_set<lambertian> diffuse_materials;
+typedef material_set<lambertian, metal> opaque_materials;
+typedef material_set<lambertian, metal, dielectric> all_materials;
+
+// Kinds of the materials created on the device since the last
+// material_mask_reset().  scene_build resets the mask before it creates a
+// scene and keeps it with the scene, so each scene gets the kernels of its
+// own materials whatever was built before it.
+inline void material_mask_reset() {
+    int mask = 0;
+    checkCudaErrors(cudaMemcpyToSymbol(material_kinds_created, &mask, sizeof(int)));
+}
+
+inline int scene_material_mask() {
+    int mask;
+    checkCudaErrors(cudaMemcpyFromSymbol(&mask, material_kinds_created, sizeof(int)));
+    return mask;
+}
+
+#endif
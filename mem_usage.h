@@ -0,0 +1,86 @@
+#ifndef MEMUSAGEH
+#define MEMUSAGEH
+
+#include <stdio.h>
+#include <iostream>
+#include <mutex>
+
+// Where the memory of a run goes.  The allocation sites tell mem_alloc and
+// mem_release what they took, by category, and mem_report prints the peak
+// of each and of all device memory together.  Objects the creation kernels
+// make with device side new live on the device heap and are counted at
+// their sizeof.  Pinned host memory is kept out of the device total.  The
+// byte counts of the allocations are functions next to them, so a dry run
+// (-dry-run) can add up the footprint of a render without allocating.
+enum { MEM_FRAMEBUFFER, MEM_AOV, MEM_SCENE, MEM_MATERIALS, MEM_ACCEL, MEM_SCRATCH, MEM_PINNED, MEM_NUM };
+
+struct mem_usage {
+    size_t bytes[MEM_NUM];
+    size_t peak[MEM_NUM];
+    size_t device, device_peak;     // all but MEM_PINNED
+    std::mutex lock;
+};
+
+inline mem_usage& mem_accounts() {
+    static mem_usage m;
+    return m;
+}
+
+inline const char *mem_category_name(int category) {
+    static const char *names[MEM_NUM] = { "framebuffer", "AOVs", "scene", "materials", "acceleration", "scratch",
+                                          "pinned host" };
+    return names[category];
+}
+
+inline void mem_alloc(int category, size_t bytes) {
+    mem_usage& m = mem_accounts();
+    std::lock_guard<std::mutex> guard(m.lock);
+    m.bytes[category] += bytes;
+    if (m.bytes[category] > m.peak[category]) m.peak[category] = m.bytes[category];
+    if (category == MEM_PINNED)
+        return;
+    m.device += bytes;
+    if (m.device > m.device_peak) m.device_peak = m.device;
+}
+
+inline void mem_release(int category, size_t bytes) {
+    mem_usage& m = mem_accounts();
+    std::lock_guard<std::mutex> guard(m.lock);
+    m.bytes[category] -= bytes;
+    if (category != MEM_PINNED) m.device -= bytes;
+}
+
+inline void mem_print_bytes(std::ostream& out, size_t bytes) {
+    char buf[32];
+    if (bytes >= (size_t(1) << 20)) snprintf(buf, sizeof(buf), "%.1f MB", bytes / double(1 << 20));
+    else if (bytes >= 1024) snprintf(buf, sizeof(buf), "%.1f kB", bytes / 1024.0);
+    else snprintf(buf, sizeof(buf), "%d bytes", int(bytes));
+    out << buf;
+}
+
+// One line with total device bytes and the bytes of each category that
+// has any, e.g.
+//   memory peak 7.4 MB on the device: framebuffer 2.9 MB, AOVs 4.4 MB, ...
+inline void mem_print(std::ostream& out, const char *label, size_t device, const size_t *bytes) {
+    out << label << " ";
+    mem_print_bytes(out, device);
+    out << " on the device";
+    const char *sep = ": ";
+    for (int c = 0; c < MEM_NUM; c++) {
+        if (!bytes[c]) continue;
+        out << sep << mem_category_name(c) << " ";
+        mem_print_bytes(out, bytes[c]);
+        sep = ", ";
+    }
+    out << ".\n";
+}
+
+// the peaks so far; those of the categories need not have been at the
+// same time, the device peak is
+inline void mem_report(std::ostream& out) {
+    mem_usage& m = mem_accounts();
+    std::lock_guard<std::mutex> guard(m.lock);
+    mem_print(out, "memory peak", m.device_peak, m.peak);
+}
+
+#endif
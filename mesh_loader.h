@@ -0,0 +1,389 @@
+#ifndef MESHLOADERH
+#define MESHLOADERH
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Host side mesh loading straight into structure of arrays, ready for
+// mesh_upload().  Files are memory mapped and arrays are sized up front, so
+// nothing is allocated per vertex or per triangle.
+struct host_mesh {
+    std::vector<float> vx, vy, vz;
+    std::vector<int> indices;   // three per triangle
+
+    int num_vertices() const { return int(vx.size()); }
+    int num_triangles() const { return int(indices.size() / 3); }
+};
+
+class mapped_file {
+    public:
+        mapped_file() : data(NULL), size(0) {}
+        ~mapped_file() { if (data) munmap((void *)data, size); }
+        bool open(const char *path) {
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return false; }
+            size = size_t(st.st_size);
+            void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) { size = 0; return false; }
+            madvise(p, size, MADV_SEQUENTIAL);
+            data = (const char *)p;
+            return true;
+        }
+        const char *data;
+        size_t size;
+};
+
+// --- binary little endian PLY ---
+
+static int ply_type_size(const char *type) {
+    if (!strcmp(type, "char") || !strcmp(type, "uchar") || !strcmp(type, "int8") || !strcmp(type, "uint8")) return 1;
+    if (!strcmp(type, "short") || !strcmp(type, "ushort") || !strcmp(type, "int16") || !strcmp(type, "uint16")) return 2;
+    if (!strcmp(type, "int") || !strcmp(type, "uint") || !strcmp(type, "int32") || !strcmp(type, "uint32") ||
+        !strcmp(type, "float") || !strcmp(type, "float32")) return 4;
+    if (!strcmp(type, "double") || !strcmp(type, "float64")) return 8;
+    return 0;
+}
+
+static bool ply_type_is_float(const char *type) {
+    return !strcmp(type, "float") || !strcmp(type, "float32") || !strcmp(type, "double") || !strcmp(type, "float64");
+}
+
+// reads one unaligned value of the given size, converted to double
+static double ply_read(const char *p, int size, bool is_float, bool is_signed) {
+    if (is_float) {
+        if (size == 4) { float f; memcpy(&f, p, 4); return f; }
+        double d; memcpy(&d, p, 8); return d;
+    }
+    switch (size) {
+        case 1: return is_signed ? double(*(const signed char *)p) : double(*(const unsigned char *)p);
+        case 2: { unsigned short u; memcpy(&u, p, 2); return is_signed ? double(short(u)) : double(u); }
+        default: { unsigned int u; memcpy(&u, p, 4); return is_signed ? double(int(u)) : double(u); }
+    }
+}
+
+struct ply_property {
+    std::string name;
+    int size;            // value size, for lists the index size
+    int count_size;      // 0 unless this is a list
+    bool is_float, is_signed;
+};
+
+struct ply_element {
+    std::string name;
+    long count;
+    std::vector<ply_property> props;
+};
+
+bool load_ply(const char *path, host_mesh& mesh) {
+    mapped_file f;
+    if (!f.open(path)) {
+        fprintf(stderr, "could not map %s\n", path);
+        return false;
+    }
+    const char *end_tag = "end_header\n";
+    const char *header_end = (const char *)memmem(f.data, f.size, end_tag, strlen(end_tag));
+    if (f.size < 4 || strncmp(f.data, "ply\n", 4) || !header_end) {
+        fprintf(stderr, "%s is not a PLY file\n", path);
+        return false;
+    }
+
+    std::vector<ply_element> elements;
+    bool binary_le = false;
+    std::string header(f.data, header_end);
+    size_t pos = 0;
+    while (pos < header.size()) {
+        size_t eol = header.find('\n', pos);
+        if (eol == std::string::npos) eol = header.size();
+        std::string line = header.substr(pos, eol - pos);
+        pos = eol + 1;
+        char a[64], b[64], c[64], d[64];
+        long count;
+        if (sscanf(line.c_str(), "format %63s", a) == 1) {
+            binary_le = !strcmp(a, "binary_little_endian");
+        }
+        else if (sscanf(line.c_str(), "element %63s %ld", a, &count) == 2) {
+            if (count < 0 || count > INT_MAX) {
+                fprintf(stderr, "%s: bad count of element %s\n", path, a);
+                return false;
+            }
+            ply_element e;
+            e.name = a;
+            e.count = count;
+            elements.push_back(e);
+        }
+        else if (sscanf(line.c_str(), "property list %63s %63s %63s", a, b, c) == 3 && !elements.empty()) {
+            // counts and indices are integers
+            if (!ply_type_size(a) || !ply_type_size(b) || ply_type_is_float(a) || ply_type_is_float(b)) {
+                fprintf(stderr, "%s: bad list property %s\n", path, c);
+                return false;
+            }
+            ply_property p = { c, ply_type_size(b), ply_type_size(a), false, b[0] != 'u' };
+            elements.back().props.push_back(p);
+        }
+        else if (sscanf(line.c_str(), "property %63s %63s", a, d) == 2 && !elements.empty()) {
+            if (!ply_type_size(a)) {
+                fprintf(stderr, "%s: unknown type %s of property %s\n", path, a, d);
+                return false;
+            }
+            ply_property p = { d, ply_type_size(a), 0, ply_type_is_float(a), a[0] != 'u' };
+            elements.back().props.push_back(p);
+        }
+    }
+    if (!binary_le) {
+        fprintf(stderr, "%s: only binary little endian PLY files are supported\n", path);
+        return false;
+    }
+
+    const char *p = header_end + strlen(end_tag);
+    const char *data_end = f.data + f.size;
+    for (const ply_element& e : elements) {
+        if (e.name == "vertex") {
+            // fixed size records: locate x, y and z once, then stride through
+            int stride = 0, off[3] = { -1, -1, -1 }, idx[3] = { 0, 0, 0 };
+            for (size_t k = 0; k < e.props.size(); k++) {
+                const ply_property& prop = e.props[k];
+                if (prop.count_size) { fprintf(stderr, "%s: list properties on vertices\n", path); return false; }
+                for (int axis = 0; axis < 3; axis++)
+                    if (prop.name == std::string(1, char('x' + axis))) { off[axis] = stride; idx[axis] = int(k); }
+                stride += prop.size;
+            }
+            if (off[0] < 0 || off[1] < 0 || off[2] < 0 || e.count > (data_end - p) / stride) {
+                fprintf(stderr, "%s: bad vertex element\n", path);
+                return false;
+            }
+            mesh.vx.resize(e.count);
+            mesh.vy.resize(e.count);
+            mesh.vz.resize(e.count);
+            float *dst[3] = { mesh.vx.data(), mesh.vy.data(), mesh.vz.data() };
+            for (int axis = 0; axis < 3; axis++) {
+                const ply_property& prop = e.props[idx[axis]];
+                if (prop.is_float && prop.size == 4) {
+                    for (long v = 0; v < e.count; v++)
+                        memcpy(&dst[axis][v], p + v*stride + off[axis], 4);
+                }
+                else {
+                    for (long v = 0; v < e.count; v++)
+                        dst[axis][v] = float(ply_read(p + v*stride + off[axis], prop.size, prop.is_float, prop.is_signed));
+                }
+            }
+            p += e.count*stride;
+        }
+        else if (e.name == "face") {
+            if (e.props.size() != 1 || !e.props[0].count_size) {
+                fprintf(stderr, "%s: faces must only hold the vertex index list\n", path);
+                return false;
+            }
+            const ply_property& prop = e.props[0];
+            // first walk to size the index array, polygons become fans
+            long num_tris = 0;
+            const char *q = p;
+            for (long i = 0; i < e.count; i++) {
+                if (data_end - q < prop.count_size) { fprintf(stderr, "%s: truncated faces\n", path); return false; }
+                long n = long(ply_read(q, prop.count_size, false, false));
+                q += prop.count_size;
+                if (n > (data_end - q) / prop.size) { fprintf(stderr, "%s: truncated faces\n", path); return false; }
+                num_tris += n >= 3 ? n-2 : 0;
+                q += n*prop.size;
+            }
+            if (num_tris > INT_MAX / 3) { fprintf(stderr, "%s: too many triangles\n", path); return false; }
+            mesh.indices.resize(3*num_tris);
+            int *out = mesh.indices.data();
+            for (long i = 0; i < e.count; i++) {
+                int n = int(ply_read(p, prop.count_size, false, false));
+                p += prop.count_size;
+                int first = int(ply_read(p, prop.size, false, prop.is_signed));
+                int prev = n > 1 ? int(ply_read(p + prop.size, prop.size, false, prop.is_signed)) : 0;
+                for (int k = 2; k < n; k++) {
+                    int cur = int(ply_read(p + k*prop.size, prop.size, false, prop.is_signed));
+                    *out++ = first; *out++ = prev; *out++ = cur;
+                    prev = cur;
+                }
+                p += n*prop.size;
+            }
+        }
+        else {
+            // skip other fixed size elements
+            int stride = 0;
+            for (const ply_property& prop : e.props) {
+                if (prop.count_size) { fprintf(stderr, "%s: can't skip list element %s\n", path, e.name.c_str()); return false; }
+                stride += prop.size;
+            }
+            if (stride && e.count > (data_end - p) / stride) {
+                fprintf(stderr, "%s: truncated element %s\n", path, e.name.c_str());
+                return false;
+            }
+            p += e.count*stride;
+        }
+    }
+    for (int v : mesh.indices) {
+        if (v < 0 || v >= mesh.num_vertices()) { fprintf(stderr, "%s: vertex index out of range\n", path); return false; }
+    }
+    return true;
+}
+
+// --- OBJ, parsed in parallel chunks ---
+
+struct obj_chunk {
+    size_t begin, end;
+    long num_vertices, num_triangles;     // counted in the first pass
+    long vertex_offset, triangle_offset;  // prefix sums over the chunks before
+    bool ok;
+};
+
+// copies one line into buf (NUL terminated, truncated if needed) and returns the start of the next
+static size_t obj_line(const char *data, size_t pos, size_t end, char *buf, size_t buf_size) {
+    size_t eol = pos;
+    while (eol < end && data[eol] != '\n') eol++;
+    size_t len = eol - pos < buf_size-1 ? eol - pos : buf_size-1;
+    memcpy(buf, data + pos, len);
+    buf[len] = 0;
+    return eol + 1;
+}
+
+static int obj_face_corners(const char *s) {
+    int n = 0;
+    s += 2;
+    while (*s) {
+        while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+        if (!*s) break;
+        n++;
+        while (*s && *s != ' ' && *s != '\t' && *s != '\r') s++;
+    }
+    return n;
+}
+
+static void obj_count(const char *data, obj_chunk& c) {
+    char buf[4096];
+    c.num_vertices = c.num_triangles = 0;
+    for (size_t pos = c.begin; pos < c.end; ) {
+        pos = obj_line(data, pos, c.end, buf, sizeof(buf));
+        if (buf[0] == 'v' && (buf[1] == ' ' || buf[1] == '\t')) c.num_vertices++;
+        else if (buf[0] == 'f' && (buf[1] == ' ' || buf[1] == '\t')) {
+            int n = obj_face_corners(buf);
+            if (n >= 3) c.num_triangles += n-2;
+        }
+    }
+}
+
+static void obj_parse(const char *data, obj_chunk& c, host_mesh& mesh) {
+    char buf[4096];
+    long v = c.vertex_offset;
+    int *out = mesh.indices.data() + 3*c.triangle_offset;
+    c.ok = true;
+    for (size_t pos = c.begin; pos < c.end; ) {
+        pos = obj_line(data, pos, c.end, buf, sizeof(buf));
+        if (buf[0] == 'v' && (buf[1] == ' ' || buf[1] == '\t')) {
+            char *s = buf + 2;
+            mesh.vx[v] = strtof(s, &s);
+            mesh.vy[v] = strtof(s, &s);
+            mesh.vz[v] = strtof(s, &s);
+            v++;
+        }
+        else if (buf[0] == 'f' && (buf[1] == ' ' || buf[1] == '\t')) {
+            if (obj_face_corners(buf) < 3) continue;
+            char *s = buf + 2;
+            int corner = 0, first = 0, prev = 0;
+            for (;;) {
+                while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+                if (!*s) break;
+                // "i", "i/t", "i//n" or "i/t/n": only the position index matters
+                long idx = strtol(s, &s, 10);
+                while (*s && *s != ' ' && *s != '\t' && *s != '\r') s++;
+                // negative indices count back from the last vertex so far
+                int vi = int(idx < 0 ? v + idx : idx - 1);
+                if (idx == 0) c.ok = false;
+                if (corner == 0) first = vi;
+                else if (corner >= 2) { *out++ = first; *out++ = prev; *out++ = vi; }
+                prev = vi;
+                corner++;
+            }
+        }
+    }
+}
+
+bool load_obj(const char *path, host_mesh& mesh, int num_threads) {
+    mapped_file f;
+    if (!f.open(path)) {
+        fprintf(stderr, "could not map %s\n", path);
+        return false;
+    }
+    if (num_threads < 1) num_threads = 1;
+
+    // split at line starts so no line straddles two chunks
+    std::vector<obj_chunk> chunks(num_threads);
+    for (int k = 0; k < num_threads; k++) {
+        size_t b = f.size * k / num_threads;
+        if (k > 0) {
+            while (b < f.size && f.data[b-1] != '\n') b++;
+        }
+        chunks[k].begin = b;
+        if (k > 0) chunks[k-1].end = b;
+    }
+    chunks[num_threads-1].end = f.size;
+
+    std::vector<std::thread> threads;
+    for (int k = 0; k < num_threads; k++)
+        threads.push_back(std::thread(obj_count, f.data, std::ref(chunks[k])));
+    for (std::thread& t : threads) t.join();
+    threads.clear();
+
+    long num_vertices = 0, num_triangles = 0;
+    for (obj_chunk& c : chunks) {
+        c.vertex_offset = num_vertices;
+        c.triangle_offset = num_triangles;
+        num_vertices += c.num_vertices;
+        num_triangles += c.num_triangles;
+    }
+    mesh.vx.resize(num_vertices);
+    mesh.vy.resize(num_vertices);
+    mesh.vz.resize(num_vertices);
+    mesh.indices.resize(3*num_triangles);
+
+    for (int k = 0; k < num_threads; k++)
+        threads.push_back(std::thread(obj_parse, f.data, std::ref(chunks[k]), std::ref(mesh)));
+    for (std::thread& t : threads) t.join();
+
+    for (const obj_chunk& c : chunks) {
+        if (!c.ok) { fprintf(stderr, "%s: bad face index\n", path); return false; }
+    }
+    for (int v : mesh.indices) {
+        if (v < 0 || v >= mesh.num_vertices()) { fprintf(stderr, "%s: vertex index out of range\n", path); return false; }
+    }
+    return true;
+}
+
+// picks the loader from the file extension
+bool load_mesh(const char *path, host_mesh& mesh) {
+    const char *ext = strrchr(path, '.');
+    bool ok;
+    if (ext && !strcasecmp(ext, ".ply"))
+        ok = load_ply(path, mesh);
+    else if (ext && !strcasecmp(ext, ".obj")) {
+        unsigned n = std::thread::hardware_concurrency();
+        ok = load_obj(path, mesh, n ? int(n) : 4);
+    }
+    else {
+        fprintf(stderr, "%s: unknown mesh format\n", path);
+        return false;
+    }
+    // the BVH needs at least one triangle
+    if (ok && mesh.num_triangles() == 0) {
+        fprintf(stderr, "%s: no triangles\n", path);
+        return false;
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef PERFCOUNTERSH
+#define PERFCOUNTERSH
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Hardware counters of the calling thread through Linux perf_event_open,
+// for the host side of a render (scene builds, image output, the frame
+// writer thread) and for the host benchmarks.  Each counter is opened on
+// its own, so whatever the kernel, the CPU or a container's seccomp and
+// perf_event_paranoid settings allow is counted and the rest reports as
+// n/a; with none at all perf_report says why once.  Counts are scaled up
+// when the kernel had to multiplex the counters.
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_NUM };
+
+struct perf_counters {
+    int fd[PERF_NUM];
+    double value[PERF_NUM];     // summed over the start/stop pairs
+    int error;                  // errno of the first counter that failed to open
+};
+
+// set by -perf, so threads started elsewhere count too
+inline bool& perf_enabled() {
+    static bool on = false;
+    return on;
+}
+
+inline void perf_open(perf_counters& pc) {
+    pc.error = 0;
+    for (int c = 0; c < PERF_NUM; c++) {
+        pc.fd[c] = -1;
+        pc.value[c] = 0.0;
+    }
+#ifdef __linux__
+    static const unsigned int types[PERF_NUM] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                                   PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+    static const unsigned long long configs[PERF_NUM] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    for (int c = 0; c < PERF_NUM; c++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[c];
+        attr.config = configs[c];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc.fd[c] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (pc.fd[c] < 0 && !pc.error)
+            pc.error = errno;
+    }
+#else
+    pc.error = ENOSYS;
+#endif
+}
+
+inline bool perf_available(const perf_counters& pc) {
+    for (int c = 0; c < PERF_NUM; c++)
+        if (pc.fd[c] >= 0) return true;
+    return false;
+}
+
+inline void perf_start(perf_counters& pc) {
+#ifdef __linux__
+    for (int c = 0; c < PERF_NUM; c++) {
+        if (pc.fd[c] < 0) continue;
+        ioctl(pc.fd[c], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc.fd[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+inline void perf_stop(perf_counters& pc) {
+#ifdef __linux__
+    for (int c = 0; c < PERF_NUM; c++) {
+        if (pc.fd[c] < 0) continue;
+        ioctl(pc.fd[c], PERF_EVENT_IOC_DISABLE, 0);
+        unsigned long long v[3];    // value, time enabled, time running
+        if (read(pc.fd[c], v, sizeof(v)) != sizeof(v) || !v[2])
+            continue;
+        pc.value[c] += double(v[0]) * double(v[1]) / double(v[2]);
+    }
+#endif
+}
+
+inline void perf_close(perf_counters& pc) {
+    for (int c = 0; c < PERF_NUM; c++)
+        if (pc.fd[c] >= 0) close(pc.fd[c]);
+}
+
+// One line for what was counted, with the misses per item (rays, pixels,
+// ...) when items is nonzero, e.g.
+//   scene build: IPC 1.9, 0.8 L1D misses, n/a LLC misses, 0.01 branch misses per sphere
+inline void perf_report(std::ostream& out, const perf_counters& pc, const char *label, double items = 0.0,
+                        const char *item = "item") {
+    if (!perf_available(pc)) {
+        static bool told = false;
+        if (!told)
+            out << "hardware counters unavailable: " << strerror(pc.error)
+                << (pc.error == EACCES || pc.error == EPERM ? " (see /proc/sys/kernel/perf_event_paranoid)" : "")
+                << "\n";
+        told = true;
+        return;
+    }
+    char buf[64];
+    out << label << ": ";
+    if (pc.fd[PERF_CYCLES] >= 0 && pc.fd[PERF_INSTRUCTIONS] >= 0 && pc.value[PERF_CYCLES] > 0.0) {
+        snprintf(buf, sizeof(buf), "IPC %.2f, ", pc.value[PERF_INSTRUCTIONS] / pc.value[PERF_CYCLES]);
+        out << buf;
+    }
+    else {
+        out << "IPC n/a, ";
+    }
+    static const char *names[] = { "L1D", "LLC", "branch" };
+    double per = items > 0.0 ? items : 1.0;
+    for (int c = PERF_L1D_MISSES; c < PERF_NUM; c++) {
+        if (pc.fd[c] >= 0)
+            snprintf(buf, sizeof(buf), "%.4g", pc.value[c] / per);
+        else
+            snprintf(buf, sizeof(buf), "n/a");
+        out << buf << " " << names[c - PERF_L1D_MISSES] << " misses" << (c+1 < PERF_NUM ? ", " : "");
+    }
+    if (items > 0.0)
+        out << " per " << item;
+    out << "\n";
+}
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef PROFILEH
+#define PROFILEH
+
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "check_cuda.h"
+#include "mem_usage.h"
+#include "ray.h"
+
+// Where color() spends its time.  -DRT_PROFILE builds count, per pixel and
+// over all its samples, the bounces traced, the primitives tested and the
+// cycles taken (clock64), and per kind of surface hit the bounces and the
+// cycles of those bounces (test plus scatter), so the cost of a scene can be
+// pinned on e.g. dielectrics bouncing to the depth limit.  The counters are
+// only kept while allocated and add up over renders; without RT_PROFILE
+// the hooks compile to nothing.
+#define PROFILE_MAX_PATH 64     // longer paths go in the last bin
+#define PROFILE_SKY 3           // after the material_kinds, for rays that hit nothing
+#define PROFILE_KINDS 4
+
+struct profile_counters {
+    int num_pixels;
+    unsigned int *bounces;          // per pixel
+    unsigned int *tests;
+    unsigned long long *cycles;
+    unsigned long long *path_lengths;   // paths by bounces, PROFILE_MAX_PATH+1 bins
+    unsigned long long *kind_bounces;   // by PROFILE_KINDS
+    unsigned long long *kind_cycles;
+};
+
+// what a path or a pixel has gathered so far
+struct path_stats {
+#ifdef RT_PROFILE
+    unsigned int bounces, tests;
+    __device__ path_stats() : bounces(0), tests(0) {}
+#endif
+};
+
+#ifdef RT_PROFILE
+__device__ profile_counters d_profile;
+#endif
+
+__device__ inline long long profile_clock() {
+#ifdef RT_PROFILE
+    return clock64();
+#else
+    return 0;
+#endif
+}
+
+// after the world was tested against r, which hit a surface of the given
+// kind, start is the profile_clock() from before the test
+__device__ inline void profile_bounce(path_stats& path, const ray& r, int kind, long long start) {
+#ifdef RT_PROFILE
+    path.bounces++;
+    path.tests += r.tests;
+    if (d_profile.num_pixels) {
+        atomicAdd(&d_profile.kind_bounces[kind], 1ull);
+        atomicAdd(&d_profile.kind_cycles[kind], (unsigned long long)(clock64() - start));
+    }
+#endif
+}
+
+// a path ended, its stats go into the histogram and add up in pixel
+__device__ inline void profile_path(path_stats& pixel, const path_stats& path) {
+#ifdef RT_PROFILE
+    pixel.bounces += path.bounces;
+    pixel.tests += path.tests;
+    if (d_profile.num_pixels)
+        atomicAdd(&d_profile.path_lengths[path.bounces < PROFILE_MAX_PATH ? path.bounces : PROFILE_MAX_PATH], 1ull);
+#endif
+}
+
+__device__ inline void profile_pixel(int pixel_index, const path_stats& pixel, long long start) {
+#ifdef RT_PROFILE
+    if (pixel_index >= d_profile.num_pixels)
+        return;
+    d_profile.bounces[pixel_index] += pixel.bounces;
+    d_profile.tests[pixel_index] += pixel.tests;
+    d_profile.cycles[pixel_index] += clock64() - start;
+#endif
+}
+
+// starts counting for an image of num_pixels, false in builds without
+// RT_PROFILE
+inline bool profile_alloc(profile_counters& p, int num_pixels) {
+#ifdef RT_PROFILE
+    p.num_pixels = num_pixels;
+    checkCudaErrors(cudaMallocManaged((void **)&p.bounces, num_pixels*sizeof(unsigned int)));
+    checkCudaErrors(cudaMallocManaged((void **)&p.tests, num_pixels*sizeof(unsigned int)));
+    checkCudaErrors(cudaMallocManaged((void **)&p.cycles, num_pixels*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMallocManaged((void **)&p.path_lengths, (PROFILE_MAX_PATH+1)*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMallocManaged((void **)&p.kind_bounces, PROFILE_KINDS*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMallocManaged((void **)&p.kind_cycles, PROFILE_KINDS*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMemset(p.bounces, 0, num_pixels*sizeof(unsigned int)));
+    checkCudaErrors(cudaMemset(p.tests, 0, num_pixels*sizeof(unsigned int)));
+    checkCudaErrors(cudaMemset(p.cycles, 0, num_pixels*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMemset(p.path_lengths, 0, (PROFILE_MAX_PATH+1)*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMemset(p.kind_bounces, 0, PROFILE_KINDS*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMemset(p.kind_cycles, 0, PROFILE_KINDS*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMemcpyToSymbol(d_profile, &p, sizeof(p)));
+    mem_alloc(MEM_SCRATCH, num_pixels*(2*sizeof(unsigned int) + sizeof(unsigned long long)));
+    return true;
+#else
+    p.num_pixels = 0;
+    return false;
+#endif
+}
+
+inline void profile_free(profile_counters& p) {
+#ifdef RT_PROFILE
+    profile_counters off = {};
+    checkCudaErrors(cudaMemcpyToSymbol(d_profile, &off, sizeof(off)));
+    checkCudaErrors(cudaFree(p.bounces));
+    checkCudaErrors(cudaFree(p.tests));
+    checkCudaErrors(cudaFree(p.cycles));
+    checkCudaErrors(cudaFree(p.path_lengths));
+    checkCudaErrors(cudaFree(p.kind_bounces));
+    checkCudaErrors(cudaFree(p.kind_cycles));
+    mem_release(MEM_SCRATCH, p.num_pixels*(2*sizeof(unsigned int) + sizeof(unsigned long long)));
+#endif
+    p.num_pixels = 0;
+}
+
+// black through blue, red and yellow to white for 0..1
+inline vec3 heat_color(float x) {
+    static const vec3 ramp[] = { vec3(0, 0, 0), vec3(0.1f, 0.1f, 0.8f), vec3(0.9f, 0.1f, 0.1f), vec3(1, 0.9f, 0),
+                                 vec3(1, 1, 1) };
+    x = std::min(std::max(x, 0.0f), 1.0f) * 4.0f;
+    int k = std::min(int(x), 3);
+    float t = x - k;
+    return (1.0f-t)*ramp[k] + t*ramp[k+1];
+}
+
+// A heatmap of values scaled so their 99th percentile is white, which
+// keeps a few runaway pixels from washing out the rest.  Returns that
+// percentile.
+template <typename T>
+double write_heatmap(const char *path, const T *values, int nx, int ny) {
+    std::vector<T> sorted(values, values + size_t(nx)*ny);
+    std::sort(sorted.begin(), sorted.end());
+    double top = double(sorted[size_t(0.99*(sorted.size()-1))]);
+    std::ofstream out(path);
+    out << "P3\n" << nx << " " << ny << "\n255\n";
+    for (int j = ny-1; j >= 0; j--) {
+        for (int i = 0; i < nx; i++) {
+            vec3 c = heat_color(top > 0.0 ? float(values[j*nx + i] / top) : 0.0f);
+            out << int(255.99f*c.r()) << " " << int(255.99f*c.g()) << " " << int(255.99f*c.b()) << "\n";
+        }
+    }
+    if (!out)
+        std::cerr << "could not write " << path << "\n";
+    return top;
+}
+
+// Writes <prefix>_bounces.ppm, <prefix>_tests.ppm and <prefix>_cycles.ppm,
+// and the summary, which also goes to stderr, to <prefix>.txt.
+inline void profile_write(const profile_counters& p, int nx, int ny, int ns, const std::string& prefix) {
+    checkCudaErrors(cudaDeviceSynchronize());
+    std::ostringstream s;
+    s << "profile of " << nx << "x" << ny << " at " << ns << " samples per pixel, 99th percentiles per pixel: "
+      << write_heatmap((prefix + "_bounces.ppm").c_str(), p.bounces, nx, ny) << " bounces, "
+      << write_heatmap((prefix + "_tests.ppm").c_str(), p.tests, nx, ny) << " primitive tests, "
+      << write_heatmap((prefix + "_cycles.ppm").c_str(), p.cycles, nx, ny) << " cycles\n";
+
+    unsigned long long paths = 0, bounces = 0, tests = 0, cycles = 0;
+    for (int i = 0; i <= PROFILE_MAX_PATH; i++) paths += p.path_lengths[i];
+    for (int i = 0; i < nx*ny; i++) {
+        tests += p.tests[i];
+        cycles += p.cycles[i];
+    }
+    for (int k = 0; k < PROFILE_KINDS; k++) bounces += p.kind_bounces[k];
+    s << paths << " paths, " << double(bounces)/std::max(paths, 1ull) << " bounces and "
+      << double(tests)/std::max(bounces, 1ull) << " primitive tests per bounce, "
+      << double(cycles)/std::max(paths, 1ull) << " cycles per path\n";
+
+    s << "bounces  paths\n";
+    for (int i = 0; i <= PROFILE_MAX_PATH; i++) {
+        if (!p.path_lengths[i]) continue;
+        s << (i == PROFILE_MAX_PATH ? ">=" : "  ") << i << "\t" << p.path_lengths[i] << "\t"
+          << std::string(size_t(60.0*p.path_lengths[i]/std::max(paths, 1ull)), '#') << "\n";
+    }
+
+    static const char *kinds[PROFILE_KINDS] = { "lambertian", "metal", "dielectric", "sky" };
+    unsigned long long kind_cycles = 0;
+    for (int k = 0; k < PROFILE_KINDS; k++) kind_cycles += p.kind_cycles[k];
+    s << "hit         bounces  share   cycles/bounce  share of cycles\n";
+    for (int k = 0; k < PROFILE_KINDS; k++) {
+        s << kinds[k] << std::string(12 - strlen(kinds[k]), ' ') << p.kind_bounces[k] << "\t"
+          << 100.0*p.kind_bounces[k]/std::max(bounces, 1ull) << "%\t"
+          << double(p.kind_cycles[k])/std::max(p.kind_bounces[k], 1ull) << "\t"
+          << 100.0*p.kind_cycles[k]/std::max(kind_cycles, 1ull) << "%\n";
+    }
+    std::cerr << s.str();
+    std::ofstream out((prefix + ".txt").c_str());
+    out << s.str();
+    if (!out)
+        std::cerr << "could not write " << prefix << ".txt\n";
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef QBVH4H
+#define QBVH4H
+
+#include <math.h>
+#include "bvh4.h"
+
+// BVH4 with child boxes quantized to 8 bits per coordinate, relative to a
+// frame spanning the union of the children (after Ylitie et al., "Efficient
+// Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs", HPG 2017).
+// Per axis the frame stores its lower corner and a power of two step, so a
+// child coordinate is origin + q*step.  Lower bounds are rounded down and
+// upper bounds up, so the dequantized boxes always contain the exact ones.
+// A node takes 56 bytes instead of 112; leaf blocks are shared with bvh4.
+
+struct qbvh4_node {
+    float origin_x, origin_y, origin_z;
+    signed char exp_x, exp_y, exp_z;   // step = 2^exp
+    unsigned char pad;
+    unsigned char lo_x[BVH4_WIDTH], lo_y[BVH4_WIDTH], lo_z[BVH4_WIDTH];
+    unsigned char hi_x[BVH4_WIDTH], hi_y[BVH4_WIDTH], hi_z[BVH4_WIDTH];
+    int child[BVH4_WIDTH];             // same encoding as bvh4_node
+};
+
+__host__ __device__ inline float qbvh4_step(int e) {
+#ifdef __CUDA_ARCH__
+    return __int_as_float((e + 127) << 23);
+#else
+    return ldexpf(1.0f, e);
+#endif
+}
+
+class qbvh4: public hitable  {
+    public:
+        __device__ qbvh4() {}
+        __device__ qbvh4(const qbvh4_node *n, const bvh4_leaf *lf, hitable **l) : nodes(n), leaves(lf), list(l) {}
+        __device__ virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        __device__ virtual bool bounding_box(aabb& box) const {
+            const qbvh4_node& root = nodes[0];
+            vec3 origin(root.origin_x, root.origin_y, root.origin_z);
+            vec3 step(qbvh4_step(root.exp_x), qbvh4_step(root.exp_y), qbvh4_step(root.exp_z));
+            box = aabb(origin, origin + 255.0f*step);
+            return true;
+        }
+        const qbvh4_node *nodes;
+        const bvh4_leaf *leaves;
+        hitable **list;
+};
+
+__device__ bool qbvh4::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    vec3 org = r.origin();
+    vec3 dir = r.direction();
+    vec3 inv_dir(1.0f/dir.x(), 1.0f/dir.y(), 1.0f/dir.z());
+
+    int stack_node[BVH4_STACK_SIZE];
+    float stack_t[BVH4_STACK_SIZE];
+    int sp = 0;
+    stack_node[sp] = 0;
+    stack_t[sp++] = t_min;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    while (sp > 0) {
+        sp--;
+        if (stack_t[sp] > closest_so_far)
+            continue;
+        int idx = stack_node[sp];
+        if (idx < 0) {
+            if (bvh4_hit_leaf(leaves[~idx], list, r, t_min, closest_so_far, rec))
+                hit_anything = true;
+            continue;
+        }
+
+        // move the ray into the node frame once, then every slab bound is
+        // a single multiply-add of the 8-bit coordinate
+        const qbvh4_node& node = nodes[idx];
+        float sx = qbvh4_step(node.exp_x) * inv_dir.x();
+        float sy = qbvh4_step(node.exp_y) * inv_dir.y();
+        float sz = qbvh4_step(node.exp_z) * inv_dir.z();
+        float ox = (node.origin_x - org.x()) * inv_dir.x();
+        float oy = (node.origin_y - org.y()) * inv_dir.y();
+        float oz = (node.origin_z - org.z()) * inv_dir.z();
+        float tnear[BVH4_WIDTH];
+        bool hit_child[BVH4_WIDTH];
+        #pragma unroll
+        for (int c = 0; c < BVH4_WIDTH; c++) {
+            float t0x = ox + float(node.lo_x[c]) * sx;
+            float t1x = ox + float(node.hi_x[c]) * sx;
+            float t0y = oy + float(node.lo_y[c]) * sy;
+            float t1y = oy + float(node.hi_y[c]) * sy;
+            float t0z = oz + float(node.lo_z[c]) * sz;
+            float t1z = oz + float(node.hi_z[c]) * sz;
+            float tmin = ffmax(ffmax(ffmin(t0x, t1x), ffmin(t0y, t1y)), ffmax(ffmin(t0z, t1z), t_min));
+            float tmax = ffmin(ffmin(ffmax(t0x, t1x), ffmax(t0y, t1y)), ffmin(ffmax(t0z, t1z), closest_so_far));
+            tnear[c] = tmin;
+            hit_child[c] = tmin <= tmax && node.child[c] != BVH4_EMPTY;
+        }
+
+        bvh4_push_ordered(node.child, tnear, hit_child, stack_node, stack_t, sp);
+    }
+    return hit_anything;
+}
+
+__global__ void create_qbvh4(hitable **d_bvh, const qbvh4_node *nodes, const bvh4_leaf *leaves, hitable **list) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        *d_bvh = new qbvh4(nodes, leaves, list);
+    }
+}
+
+// quantizes one axis of the used child slots of a node
+static void qbvh4_quantize_axis(const float *lo, const float *hi, const int *child, float& origin, signed char& e,
+                                unsigned char *qlo, unsigned char *qhi) {
+    float mn = FLT_MAX, mx = -FLT_MAX;
+    for (int c = 0; c < BVH4_WIDTH; c++) {
+        if (child[c] == BVH4_EMPTY) continue;
+        mn = ffmin(mn, lo[c]);
+        mx = ffmax(mx, hi[c]);
+    }
+    if (mn > mx) mn = mx = 0.0f;
+    origin = mn;
+
+    // smallest power of two step that spans the frame in 255 steps
+    int ex;
+    frexpf((mx - mn) / 255.0f, &ex);
+    if (mx == mn || ex < -126) ex = -126;
+    while (ex < 127 && origin + 255.0f*qbvh4_step(ex) < mx) ex++;
+    e = (signed char)ex;
+    float step = qbvh4_step(ex);
+
+    for (int c = 0; c < BVH4_WIDTH; c++) {
+        if (child[c] == BVH4_EMPTY) { qlo[c] = qhi[c] = 0; continue; }
+        int ql = int(floorf((lo[c] - origin) / step));
+        int qh = int(ceilf((hi[c] - origin) / step));
+        ql = ql < 0 ? 0 : (ql > 255 ? 255 : ql);
+        qh = qh < 0 ? 0 : (qh > 255 ? 255 : qh);
+        // guard against rounding in the subtraction above
+        while (ql > 0 && origin + float(ql)*step > lo[c]) ql--;
+        while (qh < 255 && origin + float(qh)*step < hi[c]) qh++;
+        qlo[c] = (unsigned char)ql;
+        qhi[c] = (unsigned char)qh;
+    }
+}
+
+struct qbvh4_accel {
+    qbvh4_node *nodes;
+    bvh4_leaf *leaves;
+    int num_nodes;
+    int num_leaves;
+};
+
+// false, allocating nothing, if bvh4_collapse refuses the tree
+bool qbvh4_build(qbvh4_accel& accel, const lbvh& bin, hitable **d_list) {
+    std::vector<bvh4_node> nodes;
+    std::vector<bvh4_leaf> leaves;
+    if (!bvh4_collapse(bin, d_list, nodes, leaves))
+        return false;
+
+    std::vector<qbvh4_node> qnodes(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const bvh4_node& n = nodes[i];
+        qbvh4_node& q = qnodes[i];
+        qbvh4_quantize_axis(n.lo_x, n.hi_x, n.child, q.origin_x, q.exp_x, q.lo_x, q.hi_x);
+        qbvh4_quantize_axis(n.lo_y, n.hi_y, n.child, q.origin_y, q.exp_y, q.lo_y, q.hi_y);
+        qbvh4_quantize_axis(n.lo_z, n.hi_z, n.child, q.origin_z, q.exp_z, q.lo_z, q.hi_z);
+        q.pad = 0;
+        for (int c = 0; c < BVH4_WIDTH; c++)
+            q.child[c] = n.child[c];
+    }
+
+    accel.num_nodes = int(qnodes.size());
+    accel.num_leaves = int(leaves.size());
+    checkCudaErrors(cudaMalloc((void **)&accel.nodes, accel.num_nodes*sizeof(qbvh4_node)));
+    checkCudaErrors(cudaMalloc((void **)&accel.leaves, accel.num_leaves*sizeof(bvh4_leaf)));
+    checkCudaErrors(cudaMemcpy(accel.nodes, qnodes.data(), accel.num_nodes*sizeof(qbvh4_node), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(accel.leaves, leaves.data(), accel.num_leaves*sizeof(bvh4_leaf), cudaMemcpyHostToDevice));
+    mem_alloc(MEM_ACCEL, accel.num_nodes*sizeof(qbvh4_node) + accel.num_leaves*sizeof(bvh4_leaf));
+    return true;
+}
+
+void qbvh4_free(qbvh4_accel& accel) {
+    checkCudaErrors(cudaFree(accel.nodes));
+    checkCudaErrors(cudaFree(accel.leaves));
+    mem_release(MEM_ACCEL, accel.num_nodes*sizeof(qbvh4_node) + accel.num_leaves*sizeof(bvh4_leaf));
+}
+
+#endif
@@ -5,14 +5,38 @@
 class ray
 {
     public:
-        __device__ ray() {}
-        __device__ ray(const vec3& a, const vec3& b) { A = a; B = b; }
-        __device__ vec3 origin() const       { return A; }
-        __device__ vec3 direction() const    { return B; }
-        __device__ vec3 point_at_parameter(float t) const { return A + t*B; }
+        __host__ __device__ ray() {}
+        __host__ __device__ ray(const vec3& a, const vec3& b) { A = a; B = b; }
+        __host__ __device__ vec3 origin() const       { return A; }
+        __host__ __device__ vec3 direction() const    { return B; }
+        __host__ __device__ vec3 point_at_parameter(float t) const { return A + t*B; }
 
         vec3 A;
         vec3 B;
+#ifdef RT_PROFILE
+        mutable unsigned int tests = 0;    // primitives tested against this ray, see profile.h
+#endif
 };
 
+// the background seen by a ray that leaves the scene
+__host__ __device__ inline vec3 sky_color(const ray& r) {
+    vec3 unit_direction = unit_vector(r.direction());
+    float t = 0.5f*(unit_direction.y() + 1.0f);
+    return (1.0f-t)*vec3(1.0, 1.0, 1.0) + t*vec3(0.5, 0.7, 1.0);
+}
+
+// counts a primitive test against r in -DRT_PROFILE builds
+__host__ __device__ inline void count_primitive_test(const ray& r) {
+#ifdef RT_PROFILE
+    r.tests++;
+#endif
+}
+
+// counts n of them at once
+__host__ __device__ inline void count_primitive_tests(const ray& r, int n) {
+#ifdef RT_PROFILE
+    r.tests += n;
+#endif
+}
+
 #endif
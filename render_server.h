@@ -0,0 +1,294 @@
+#ifndef RENDERSERVERH
+#define RENDERSERVERH
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "config.h"
+#include "framebuffer.h"
+
+// The plumbing of the render daemon (-serve).  A client connects to the
+// Unix socket and sends one line of settings separated by spaces: the
+// render and camera settings of config.h, the scene settings of
+// scene_config, fb_format=float|half|rgbe|rgb8 and priority=n (higher
+// first, default 0), e.g.
+//   echo "scene=book samples=100 lookfrom=0,2,13" | socat - UNIX-CONNECT:rt.sock > out.ppm
+// The reply is the image as a PPM, or a line starting with "error".  The
+// lines "stats" and "quit" ask for counters and stop the server.
+//
+// Connections are served by threads of their own, which queue the job and
+// wait for it.  The jobs are rendered one at a time by whoever calls
+// server_next_job, highest priority first and in arrival order within a
+// priority.  Finished images are kept, least recently used out first, up
+// to max_result_bytes, under the canonical form of their settings, so a
+// repeated request is answered without queueing.
+#define RENDER_SERVER_MAX_PIXELS (1 << 26)
+#define RENDER_SERVER_MAX_LINE 4096
+#define RENDER_SERVER_TIMEOUT 10        // seconds a client may take to send its line or read the reply
+
+struct render_request {
+    render_config cfg;
+    scene_config scene;
+    int fb_format;
+    int priority;
+    std::string key;    // the settings in canonical form, without the priority
+};
+
+inline bool parse_render_request(const std::string& line, render_request& req, std::string& error) {
+    req.cfg = default_render_config();
+    req.scene = default_scene_config();
+    req.fb_format = FB_FLOAT;
+    req.priority = 0;
+    std::istringstream settings(line);
+    std::string setting;
+    while (settings >> setting) {
+        size_t eq = setting.find('=');
+        std::string key = setting.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : setting.substr(eq+1);
+        bool ok;
+        if (key == "priority") ok = parse_int(value, req.priority, -1000000, 1000000);
+        else if (key == "fb_format") ok = (req.fb_format = parse_fb_format(value.c_str())) >= 0;
+        else ok = eq != std::string::npos && (scene_config_set(req.scene, key, value) || config_set(req.cfg, key, value));
+        if (!ok) {
+            error = "bad setting '" + setting + "'";
+            return false;
+        }
+    }
+    if (double(req.cfg.nx)*req.cfg.ny > RENDER_SERVER_MAX_PIXELS) {
+        error = "image too large";
+        return false;
+    }
+    req.key = scene_key(req.scene, req.cfg.seed) + " " + config_key(req.cfg) + " fb_format="
+            + fb_format_name(req.fb_format);
+    return true;
+}
+
+struct render_job {
+    render_request request;
+    long seq;
+    bool done;
+    std::string result;
+};
+
+// heap order: the job that should run next compares greatest
+struct render_job_order {
+    bool operator()(const render_job *a, const render_job *b) const {
+        if (a->request.priority != b->request.priority)
+            return a->request.priority < b->request.priority;
+        return a->seq > b->seq;
+    }
+};
+
+struct render_server {
+    std::string path;
+    int listen_fd;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<render_job *> queue;
+    std::list<std::pair<std::string, std::string> > results;   // most recently used first
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::string> >::iterator> result_index;
+    size_t result_bytes, max_result_bytes;
+    long next_seq;
+    long requests, cache_hits, rendered;
+    int connections;    // being answered
+    bool stopping;
+    std::thread acceptor;
+};
+
+// with the lock held
+inline bool server_cached(render_server& s, const std::string& key, std::string& result) {
+    auto it = s.result_index.find(key);
+    if (it == s.result_index.end())
+        return false;
+    s.results.splice(s.results.begin(), s.results, it->second);
+    result = it->second->second;
+    s.cache_hits++;
+    return true;
+}
+
+inline void server_send(int fd, const std::string& reply) {
+    size_t sent = 0;
+    while (sent < reply.size()) {
+        ssize_t n = send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        sent += n;
+    }
+}
+
+inline void server_handle(render_server *s, int fd) {
+    std::string line;
+    char c;
+    ssize_t n = 0;
+    while (line.size() < RENDER_SERVER_MAX_LINE && (n = read(fd, &c, 1)) == 1 && c != '\n')
+        line += c;
+    line = trim(line);
+
+    std::string reply, error;
+    render_request req;
+    if (n < 0) {
+        reply = "error: no request within " + std::to_string(RENDER_SERVER_TIMEOUT) + " seconds\n";
+    }
+    else if (line == "quit") {
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->stopping = true;
+        s->changed.notify_all();
+        reply = "ok\n";
+    }
+    else if (line == "stats") {
+        std::lock_guard<std::mutex> guard(s->lock);
+        std::ostringstream stats;
+        stats << s->requests << " requests, " << s->cache_hits << " from the cache, " << s->rendered
+              << " rendered, " << s->queue.size() << " queued, " << s->results.size() << " images cached in "
+              << s->result_bytes << " bytes\n";
+        reply = stats.str();
+    }
+    else if (!parse_render_request(line, req, error)) {
+        reply = "error: " + error + "\n";
+    }
+    else {
+        std::unique_lock<std::mutex> guard(s->lock);
+        s->requests++;
+        // server_close has failed the queue already, nothing takes jobs off it
+        if (s->stopping)
+            reply = "error: server stopped\n";
+        else if (!server_cached(*s, req.key, reply)) {
+            render_job job;
+            job.request = req;
+            job.seq = s->next_seq++;
+            job.done = false;
+            s->queue.push_back(&job);
+            std::push_heap(s->queue.begin(), s->queue.end(), render_job_order());
+            s->changed.notify_all();
+            s->changed.wait(guard, [&job]() { return job.done; });
+            reply = job.result;
+        }
+    }
+    server_send(fd, reply);
+    close(fd);
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->connections--;
+    s->changed.notify_all();
+}
+
+inline void server_accept(render_server *s) {
+    for (;;) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            std::lock_guard<std::mutex> guard(s->lock);
+            if (s->stopping)
+                return;
+            continue;
+        }
+        // so neither an idle client nor one that stops reading holds up
+        // server_close for longer than that
+        timeval timeout = { RENDER_SERVER_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        {
+            std::lock_guard<std::mutex> guard(s->lock);
+            s->connections++;
+        }
+        std::thread(server_handle, s, fd).detach();
+    }
+}
+
+inline bool server_open(render_server& s, const char *path, size_t max_result_bytes) {
+    s.path = path;
+    s.result_bytes = 0;
+    s.max_result_bytes = max_result_bytes;
+    s.next_seq = 0;
+    s.requests = s.cache_hits = s.rendered = 0;
+    s.connections = 0;
+    s.stopping = false;
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << path << "\n";
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    s.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s.listen_fd < 0 || bind(s.listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(s.listen_fd, 64) < 0) {
+        std::cerr << "could not listen on " << path << ": " << strerror(errno) << "\n";
+        if (s.listen_fd >= 0) close(s.listen_fd);
+        return false;
+    }
+    s.acceptor = std::thread(server_accept, &s);
+    return true;
+}
+
+// blocks until there is a job to render, false once the server stops
+inline bool server_next_job(render_server& s, render_job *&job) {
+    std::unique_lock<std::mutex> guard(s.lock);
+    for (;;) {
+        s.changed.wait(guard, [&s]() { return s.stopping || !s.queue.empty(); });
+        if (s.stopping)
+            return false;
+        std::pop_heap(s.queue.begin(), s.queue.end(), render_job_order());
+        job = s.queue.back();
+        s.queue.pop_back();
+        // an identical job may have finished while this one waited
+        if (!server_cached(s, job->request.key, job->result))
+            return true;
+        job->done = true;
+        s.changed.notify_all();
+    }
+}
+
+// hands the job's reply back to its connection, images are cached
+inline void server_complete(render_server& s, render_job *job, const std::string& result, bool cache) {
+    std::lock_guard<std::mutex> guard(s.lock);
+    if (cache && result.size() <= s.max_result_bytes && !s.result_index.count(job->request.key)) {
+        s.results.push_front(std::make_pair(job->request.key, result));
+        s.result_index[job->request.key] = s.results.begin();
+        s.result_bytes += result.size();
+        while (s.result_bytes > s.max_result_bytes) {
+            s.result_bytes -= s.results.back().second.size();
+            s.result_index.erase(s.results.back().first);
+            s.results.pop_back();
+        }
+    }
+    s.rendered++;
+    job->result = result;
+    job->done = true;
+    s.changed.notify_all();
+}
+
+// fails the queued jobs, stops accepting and waits for the replies to go out
+inline void server_close(render_server& s) {
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.stopping = true;
+        for (size_t i = 0; i < s.queue.size(); i++) {
+            s.queue[i]->result = "error: server stopped\n";
+            s.queue[i]->done = true;
+        }
+        s.queue.clear();
+        s.changed.notify_all();
+    }
+    shutdown(s.listen_fd, SHUT_RDWR);
+    close(s.listen_fd);
+    s.acceptor.join();
+    unlink(s.path.c_str());
+    std::unique_lock<std::mutex> guard(s.lock);
+    s.changed.wait(guard, [&s]() { return s.connections == 0; });
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef SAMPLERNGH
+#define SAMPLERNGH
+
+#include <curand_kernel.h>
+
+// Random numbers of the render.  Philox is counter based: every sample of
+// every pixel draws from a stream of its own, found from the seed and the
+// pixel's and the sample's index alone in constant time.  No state is kept
+// between samples, so an image is the same bit for bit however its pixels
+// are split between threads, tiles, schedules, launches or machines.  A
+// split of the samples draws the same numbers too, the sums over them then
+// only agree to rounding.  Scenes are still placed with a curandState of
+// their own.
+typedef curandStatePhilox4_32_10_t sample_rng;
+
+// each (pixel, sample) subsequence is 2^64 draws long, more than any path
+// takes
+__device__ inline void sample_rng_init(sample_rng *rng, unsigned int seed, int pixel_index, int sample) {
+    curand_init(seed, (unsigned long long)(unsigned int)pixel_index << 32 | (unsigned int)sample, 0, rng);
+}
+
+#endif
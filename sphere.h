@@ -1,19 +1,46 @@
 #ifndef SPHEREH
 #define SPHEREH
 
+#include <limits.h>
 #include "hitable.h"
 
+// -DHALF_RADIUS stores the radius as a half and the id in 16 bits, which
+// brings a sphere from 40 to 32 bytes (a half radius alone would be eaten by
+// the padding before mat_ptr).  The stored radius is what every consumer
+// sees, intersection math stays in float.  Scenes check their ids against
+// SPHERE_MAX_ID when they are compiled.
+#ifdef HALF_RADIUS
+#include <cuda_fp16.h>
+typedef __half sphere_radius_t;
+typedef short sphere_id_t;
+#define SPHERE_MAX_ID SHRT_MAX
+#else
+typedef float sphere_radius_t;
+typedef int sphere_id_t;
+#define SPHERE_MAX_ID INT_MAX
+#endif
+
 class sphere: public hitable  {
     public:
         __device__ sphere() {}
-        __device__ sphere(vec3 cen, float r, material *m) : center(cen), radius(r), mat_ptr(m)  {};
+        __device__ sphere(vec3 cen, float r, material *m, int id = -1) : center(cen), radius(r), prim_id(id), mat_ptr(m)  {};
         __device__ virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        __device__ virtual bool bounding_box(aabb& box) const {
+            float rad = radius;
+            box = aabb(center - vec3(rad, rad, rad), center + vec3(rad, rad, rad));
+            return true;
+        }
+        __device__ virtual bool bounding_sphere(vec3& c, float& r) const { c = center; r = radius; return true; }
         vec3 center;
-        float radius;
+        sphere_radius_t radius;
+        sphere_id_t prim_id;
         material *mat_ptr;
 };
 
-__device__ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+// nearest root of the ray/sphere quadratic in (t_min, t_max), shared with
+// the host side benchmarks
+__host__ __device__ inline bool hit_sphere(const vec3& center, float radius, const ray& r, float t_min, float t_max,
+                                           float& t) {
     vec3 oc = r.origin() - center;
     float a = dot(r.direction(), r.direction());
     float b = dot(oc, r.direction());
@@ -22,23 +49,31 @@ __device__ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record&
     if (discriminant > 0) {
         float temp = (-b - sqrt(discriminant))/a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            t = temp;
             return true;
         }
         temp = (-b + sqrt(discriminant)) / a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            t = temp;
             return true;
         }
     }
     return false;
 }
 
+__device__ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    float t;
+    float rad = radius;
+    count_primitive_test(r);
+    if (!hit_sphere(center, rad, r, t_min, t_max, t))
+        return false;
+    rec.t = t;
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center) / rad;
+    rec.mat_ptr = mat_ptr;
+    rec.prim_id = prim_id;
+    return true;
+}
+
 
 #endif
@@ -0,0 +1,153 @@
+#ifndef TILEORDERH
+#define TILEORDERH
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "check_cuda.h"
+#include "mem_usage.h"
+
+// Order in which tiles are handed to blocks, and pixels of a tile to the
+// threads of a block.  Along a Morton or Hilbert curve consecutive blocks
+// and warps cover compact 2D regions instead of long rows, so their rays
+// touch the same BVH nodes and spheres while those are still in cache.
+enum pixel_order { ORDER_ROW, ORDER_MORTON, ORDER_HILBERT };
+
+// Both orders are computed once on the host and looked up by the kernel, so
+// the curves cost nothing per pixel and any tile or image size works: the
+// curve runs over the enclosing power of two square and points outside the
+// rectangle are skipped.
+struct tile_layout {
+    int tile_w, tile_h;
+    int tiles_x, tiles_y;
+    int *tiles;      // tile index for each block, y*tiles_x + x
+    int *pixels;     // packed (y << 16 | x) offset in the tile for each thread
+    int stride;      // the layout covers every stride'th pixel in x and y
+    int skip;        // of those, pixels on the grid of every skip'th are left out, 0 for none
+};
+
+inline void morton_d2xy(unsigned int d, int& x, int& y) {
+    x = y = 0;
+    for (int b = 0; b < 16; b++) {
+        x |= ((d >> (2*b)) & 1) << b;
+        y |= ((d >> (2*b+1)) & 1) << b;
+    }
+}
+
+// the classic iterative Hilbert index to point conversion, n a power of two
+inline void hilbert_d2xy(int n, unsigned int d, int& x, int& y) {
+    x = y = 0;
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (d/2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s-1 - x;
+                y = s-1 - y;
+            }
+            int t = x; x = y; y = t;
+        }
+        x += s*rx;
+        y += s*ry;
+        d /= 4;
+    }
+}
+
+// points of a w x h rectangle in the given order, packed as (y << 16 | x)
+inline std::vector<int> curve_order(int w, int h, int order) {
+    std::vector<int> points;
+    points.reserve(w*h);
+    if (order == ORDER_ROW) {
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                points.push_back(y << 16 | x);
+        return points;
+    }
+    int n = 1;
+    while (n < w || n < h) n *= 2;
+    for (unsigned int d = 0; d < (unsigned int)(n*n); d++) {
+        int x, y;
+        if (order == ORDER_MORTON) morton_d2xy(d, x, y);
+        else hilbert_d2xy(n, d, x, y);
+        if (x < w && y < h)
+            points.push_back(y << 16 | x);
+    }
+    return points;
+}
+
+inline const char *pixel_order_name(int order) {
+    return order == ORDER_MORTON ? "morton" : order == ORDER_HILBERT ? "hilbert" : "row";
+}
+
+// -1 for an unknown name
+inline int parse_pixel_order(const char *name) {
+    if (!strcmp(name, "row")) return ORDER_ROW;
+    if (!strcmp(name, "morton")) return ORDER_MORTON;
+    if (!strcmp(name, "hilbert")) return ORDER_HILBERT;
+    return -1;
+}
+
+// "<w>x<h>", nothing after it
+inline bool parse_tile_size(const char *text, int& tile_w, int& tile_h) {
+    char rest;
+    return sscanf(text, "%dx%d%c", &tile_w, &tile_h, &rest) == 2;
+}
+
+inline size_t tile_layout_bytes(int nx, int ny, int tile_w, int tile_h) {
+    return (size_t((nx + tile_w-1) / tile_w)*((ny + tile_h-1) / tile_h) + tile_w*tile_h)*sizeof(int);
+}
+
+void tile_layout_build(tile_layout& layout, int nx, int ny, int tile_w, int tile_h, int tile_order, int in_tile_order) {
+    layout.stride = 1;
+    layout.skip = 0;
+    layout.tile_w = tile_w;
+    layout.tile_h = tile_h;
+    layout.tiles_x = (nx + tile_w-1) / tile_w;
+    layout.tiles_y = (ny + tile_h-1) / tile_h;
+    std::vector<int> tiles = curve_order(layout.tiles_x, layout.tiles_y, tile_order);
+    for (size_t t = 0; t < tiles.size(); t++)
+        tiles[t] = (tiles[t] >> 16)*layout.tiles_x + (tiles[t] & 0xffff);
+    std::vector<int> pixels = curve_order(tile_w, tile_h, in_tile_order);
+    checkCudaErrors(cudaMalloc((void **)&layout.tiles, tiles.size()*sizeof(int)));
+    checkCudaErrors(cudaMalloc((void **)&layout.pixels, pixels.size()*sizeof(int)));
+    checkCudaErrors(cudaMemcpy(layout.tiles, tiles.data(), tiles.size()*sizeof(int), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(layout.pixels, pixels.data(), pixels.size()*sizeof(int), cudaMemcpyHostToDevice));
+    mem_alloc(MEM_SCRATCH, tile_layout_bytes(nx, ny, tile_w, tile_h));
+}
+
+// One level of a coarse to fine preview: the pixels on the grid of every
+// stride'th pixel that are not on the coarser grid of every skip'th.
+void tile_layout_build_level(tile_layout& layout, int nx, int ny, int tile_w, int tile_h, int tile_order,
+                             int in_tile_order, int stride, int skip) {
+    tile_layout_build(layout, (nx + stride-1) / stride, (ny + stride-1) / stride, tile_w, tile_h, tile_order,
+                      in_tile_order);
+    layout.stride = stride;
+    layout.skip = skip;
+}
+
+void tile_layout_free(tile_layout& layout) {
+    checkCudaErrors(cudaFree(layout.tiles));
+    checkCudaErrors(cudaFree(layout.pixels));
+    mem_release(MEM_SCRATCH, (size_t(layout.tiles_x)*layout.tiles_y + layout.tile_w*layout.tile_h)*sizeof(int));
+}
+
+// launch one block of tile_w*tile_h threads per tile
+__host__ __device__ inline int tile_layout_count(const tile_layout& layout) { return layout.tiles_x*layout.tiles_y; }
+inline dim3 tile_layout_blocks(const tile_layout& layout, int num_views = 1) { return dim3(tile_layout_count(layout)*num_views); }
+inline dim3 tile_layout_threads(const tile_layout& layout) { return dim3(layout.tile_w*layout.tile_h); }
+
+// pixel of the calling thread in the slot'th tile of the order, may be
+// outside the image in edge tiles
+__device__ inline void tile_pixel(const tile_layout& layout, int slot, int& i, int& j) {
+    int tile = layout.tiles[slot];
+    int offset = layout.pixels[threadIdx.x];
+    i = ((tile % layout.tiles_x)*layout.tile_w + (offset & 0xffff))*layout.stride;
+    j = ((tile / layout.tiles_x)*layout.tile_h + (offset >> 16))*layout.stride;
+}
+
+// whether pixel (i, j) of the layout is one to leave out
+__device__ inline bool tile_pixel_skipped(const tile_layout& layout, int i, int j) {
+    return layout.skip && i % layout.skip == 0 && j % layout.skip == 0;
+}
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef TRACEH
+#define TRACEH
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "check_cuda.h"
+#include "mem_usage.h"
+
+// A timeline of a run in the Chrome trace event format, for Perfetto or
+// chrome://tracing.  -DRT_TRACE builds record every tile a block renders,
+// with the SM it ran on, and the host phases (scene build, kernels, image
+// output, also on the frame writer thread).  The tiles show up as one
+// track per SM, so a straggler or an SM left idle at the end of a launch
+// stands out.  With the persistent schedule every tile is one taken off
+// the shared counter.  Without RT_TRACE the hooks compile to nothing.
+//
+// Device times come from %globaltimer and are moved onto the host's clock
+// with an offset measured when tracing starts, good to a launch latency.
+#define TRACE_MAX_TILES (1 << 20)   // later tiles are dropped
+
+struct trace_tile {
+    unsigned long long start, end;  // ns, %globaltimer
+    unsigned int sm;
+    int launch;
+    int block;
+    int tile;
+};
+
+struct trace_phase {
+    const char *name;
+    double start, end;      // us since trace_start
+    int thread;
+};
+
+struct trace_state {
+    bool on;
+    std::chrono::steady_clock::time_point origin;
+    long long gpu_origin;   // %globaltimer at origin
+    trace_tile *tiles;
+    int launches;
+    std::vector<trace_phase> phases;
+    std::vector<std::thread::id> threads;
+    std::mutex lock;
+};
+
+inline trace_state& tracer() {
+    static trace_state t;
+    return t;
+}
+
+#ifdef RT_TRACE
+__device__ trace_tile *d_trace_tiles;
+__device__ unsigned int d_trace_count;
+__device__ int d_trace_launch;
+
+__device__ inline unsigned long long trace_clock() {
+    unsigned long long t;
+    asm volatile("mov.u64 %0, %%globaltimer;" : "=l"(t));
+    return t;
+}
+
+__global__ void trace_read_clock(unsigned long long *t) {
+    *t = trace_clock();
+}
+#else
+__device__ inline unsigned long long trace_clock() { return 0; }
+#endif
+
+// Called by the whole block once it has rendered tile, start being its
+// trace_clock() from before.  Waits for the block's threads in RT_TRACE
+// builds, so every thread of the block has to get here.
+__device__ inline void trace_tile_done(unsigned long long start, int tile) {
+#ifdef RT_TRACE
+    __syncthreads();
+    if (threadIdx.x != 0 || !d_trace_tiles)
+        return;
+    unsigned int k = atomicAdd(&d_trace_count, 1u);
+    if (k >= TRACE_MAX_TILES)
+        return;
+    unsigned int sm;
+    asm volatile("mov.u32 %0, %%smid;" : "=r"(sm));
+    trace_tile t = { start, trace_clock(), sm, d_trace_launch, int(blockIdx.x), tile };
+    d_trace_tiles[k] = t;
+#endif
+}
+
+inline double trace_now() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - tracer().origin).count();
+}
+
+// false in builds without RT_TRACE
+inline bool trace_start() {
+#ifdef RT_TRACE
+    trace_state& t = tracer();
+    unsigned long long *gpu_now;
+    checkCudaErrors(cudaMallocManaged((void **)&gpu_now, sizeof(unsigned long long)));
+    trace_read_clock<<<1,1>>>(gpu_now);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    t.origin = std::chrono::steady_clock::now();
+    t.gpu_origin = *gpu_now;
+    checkCudaErrors(cudaFree(gpu_now));
+    checkCudaErrors(cudaMalloc((void **)&t.tiles, TRACE_MAX_TILES*sizeof(trace_tile)));
+    mem_alloc(MEM_SCRATCH, TRACE_MAX_TILES*sizeof(trace_tile));
+    unsigned int zero = 0;
+    checkCudaErrors(cudaMemcpyToSymbol(d_trace_tiles, &t.tiles, sizeof(t.tiles)));
+    checkCudaErrors(cudaMemcpyToSymbol(d_trace_count, &zero, sizeof(zero)));
+    t.launches = 0;
+    t.on = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// numbers the tiles of the kernel launched next
+inline void trace_next_launch() {
+#ifdef RT_TRACE
+    trace_state& t = tracer();
+    if (!t.on)
+        return;
+    checkCudaErrors(cudaMemcpyToSymbol(d_trace_launch, &t.launches, sizeof(int)));
+    t.launches++;
+#endif
+}
+
+// host phases: trace_end(trace_begin("name")) around the work, the name
+// has to outlive the trace
+inline int trace_begin(const char *name) {
+#ifdef RT_TRACE
+    trace_state& t = tracer();
+    if (!t.on)
+        return -1;
+    std::lock_guard<std::mutex> guard(t.lock);
+    std::thread::id self = std::this_thread::get_id();
+    int thread = int(std::find(t.threads.begin(), t.threads.end(), self) - t.threads.begin());
+    if (thread == int(t.threads.size()))
+        t.threads.push_back(self);
+    trace_phase p = { name, trace_now(), -1.0, thread };
+    t.phases.push_back(p);
+    return int(t.phases.size()) - 1;
+#else
+    return -1;
+#endif
+}
+
+inline void trace_end(int phase) {
+#ifdef RT_TRACE
+    trace_state& t = tracer();
+    if (phase < 0)
+        return;
+    std::lock_guard<std::mutex> guard(t.lock);
+    t.phases[phase].end = trace_now();
+#endif
+}
+
+// Writes the trace as JSON and stops tracing.  Also reports how long the
+// SMs sat idle at the end of the launches, from the first of them running
+// out of tiles to the last one finishing, as a share of the launch.
+inline void trace_write(const char *path) {
+#ifdef RT_TRACE
+    trace_state& t = tracer();
+    if (!t.on)
+        return;
+    checkCudaErrors(cudaDeviceSynchronize());
+    unsigned int count;
+    checkCudaErrors(cudaMemcpyFromSymbol(&count, d_trace_count, sizeof(count)));
+    if (count > TRACE_MAX_TILES) {
+        std::cerr << "trace kept " << TRACE_MAX_TILES << " of " << count << " tiles.\n";
+        count = TRACE_MAX_TILES;
+    }
+    std::vector<trace_tile> tiles(count);
+    checkCudaErrors(cudaMemcpy(tiles.data(), t.tiles, count*sizeof(trace_tile), cudaMemcpyDeviceToHost));
+
+    std::ofstream out(path);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    out << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":0,\"args\":{\"name\":\"host\"}},\n";
+    out << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":\"GPU\"}}";
+    char event[256];
+    for (size_t k = 0; k < t.phases.size(); k++) {
+        const trace_phase& p = t.phases[k];
+        double end = p.end >= 0.0 ? p.end : trace_now();
+        snprintf(event, sizeof(event), ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                 p.name, p.thread, p.start, end - p.start);
+        out << event;
+    }
+    unsigned int num_sms = 0;
+    for (size_t k = 0; k < tiles.size(); k++) {
+        const trace_tile& tile = tiles[k];
+        snprintf(event, sizeof(event), ",\n{\"ph\":\"X\",\"name\":\"tile %d\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                 "\"dur\":%.3f,\"args\":{\"launch\":%d,\"block\":%d}}", tile.tile, tile.sm,
+                 (tile.start - t.gpu_origin)*1e-3, (tile.end - tile.start)*1e-3, tile.launch, tile.block);
+        out << event;
+        num_sms = std::max(num_sms, tile.sm + 1);
+    }
+    for (unsigned int sm = 0; sm < num_sms; sm++) {
+        snprintf(event, sizeof(event), ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,"
+                 "\"args\":{\"name\":\"SM %u\"}}", sm, sm);
+        out << event;
+    }
+    out << "\n]}\n";
+    if (!out)
+        std::cerr << "could not write " << path << "\n";
+
+    std::vector<unsigned long long> first(t.launches, ~0ull), last(t.launches * size_t(num_sms), 0);
+    for (size_t k = 0; k < tiles.size(); k++) {
+        const trace_tile& tile = tiles[k];
+        first[tile.launch] = std::min(first[tile.launch], tile.start);
+        unsigned long long& sm_last = last[tile.launch*size_t(num_sms) + tile.sm];
+        sm_last = std::max(sm_last, tile.end);
+    }
+    double idle_sum = 0.0, idle_worst = 0.0;
+    int launches = 0, worst = -1;
+    for (int l = 0; l < t.launches; l++) {
+        if (first[l] == ~0ull)
+            continue;
+        unsigned long long done_first = ~0ull, done_last = 0;
+        for (unsigned int sm = 0; sm < num_sms; sm++) {
+            unsigned long long e = last[l*size_t(num_sms) + sm];
+            if (!e) continue;
+            done_first = std::min(done_first, e);
+            done_last = std::max(done_last, e);
+        }
+        double idle = double(done_last - done_first) / double(done_last - first[l]);
+        idle_sum += idle;
+        launches++;
+        if (idle >= idle_worst) { idle_worst = idle; worst = l; }
+    }
+    if (launches)
+        std::cerr << "trace: " << tiles.size() << " tiles in " << launches << " launches on " << num_sms
+                  << " SMs, SMs idle at the end for " << 100.0*idle_sum/launches << "% of a launch, worst "
+                  << 100.0*idle_worst << "% in launch " << worst << ".\n";
+    checkCudaErrors(cudaFree(t.tiles));
+    mem_release(MEM_SCRATCH, TRACE_MAX_TILES*sizeof(trace_tile));
+    t.tiles = NULL;
+    checkCudaErrors(cudaMemcpyToSymbol(d_trace_tiles, &t.tiles, sizeof(t.tiles)));
+    t.on = false;
+#endif
+}
+
+#endif
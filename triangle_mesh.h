@@ -0,0 +1,166 @@
+#ifndef TRIANGLEMESHH
+#define TRIANGLEMESHH
+
+#include "check_cuda.h"
+#include "lbvh.h"
+
+// Indexed triangle mesh on the device: positions are stored as structure of
+// arrays and every triangle is three vertex indices.  The mesh carries its
+// own LBVH over the triangles and is a single hitable to the rest of the
+// scene, typically placed through an instance.  Normals are geometric and
+// follow the winding order, so closed meshes should be wound
+// counter-clockwise seen from outside for dielectrics to work.
+struct mesh_data {
+    float *vx, *vy, *vz;
+    int *indices;        // three per triangle
+    int num_vertices;
+    int num_triangles;
+};
+
+__device__ inline vec3 mesh_vertex(const mesh_data& m, int v) {
+    return vec3(m.vx[v], m.vy[v], m.vz[v]);
+}
+
+// Per ray setup of the watertight test of Woop, Benthin and Wald,
+// "Watertight Ray/Triangle Intersection" (JCGT 2013): the ray is sheared
+// onto the +z axis of a permuted frame so the edge tests are exact in the
+// sense that rays never slip through shared edges or vertices.
+struct watertight_ray {
+    int kx, ky, kz;
+    float sx, sy, sz;
+    vec3 org;
+};
+
+__device__ inline watertight_ray make_watertight_ray(const ray& r) {
+    watertight_ray wr;
+    vec3 dir = r.direction();
+    float ax = fabsf(dir.x()), ay = fabsf(dir.y()), az = fabsf(dir.z());
+    wr.kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    wr.kx = wr.kz == 2 ? 0 : wr.kz + 1;
+    wr.ky = wr.kx == 2 ? 0 : wr.kx + 1;
+    // keep the winding of the triangles
+    if (dir[wr.kz] < 0.0f) { int tmp = wr.kx; wr.kx = wr.ky; wr.ky = tmp; }
+    wr.sx = dir[wr.kx] / dir[wr.kz];
+    wr.sy = dir[wr.ky] / dir[wr.kz];
+    wr.sz = 1.0f / dir[wr.kz];
+    wr.org = r.origin();
+    return wr;
+}
+
+__device__ inline bool hit_triangle(const watertight_ray& wr, const vec3& v0, const vec3& v1, const vec3& v2,
+                                    float t_min, float t_max, float& t) {
+    vec3 A = v0 - wr.org;
+    vec3 B = v1 - wr.org;
+    vec3 C = v2 - wr.org;
+    float Ax = A[wr.kx] - wr.sx*A[wr.kz];
+    float Ay = A[wr.ky] - wr.sy*A[wr.kz];
+    float Bx = B[wr.kx] - wr.sx*B[wr.kz];
+    float By = B[wr.ky] - wr.sy*B[wr.kz];
+    float Cx = C[wr.kx] - wr.sx*C[wr.kz];
+    float Cy = C[wr.ky] - wr.sy*C[wr.kz];
+    float U = Cx*By - Cy*Bx;
+    float V = Ax*Cy - Ay*Cx;
+    float W = Bx*Ay - By*Ax;
+    // on an edge the float result can't be trusted, redo it in double
+    if (U == 0.0f || V == 0.0f || W == 0.0f) {
+        U = float(double(Cx)*double(By) - double(Cy)*double(Bx));
+        V = float(double(Ax)*double(Cy) - double(Ay)*double(Cx));
+        W = float(double(Bx)*double(Ay) - double(By)*double(Ax));
+    }
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+        return false;
+    float det = U + V + W;
+    if (det == 0.0f)
+        return false;
+    float Az = wr.sz*A[wr.kz];
+    float Bz = wr.sz*B[wr.kz];
+    float Cz = wr.sz*C[wr.kz];
+    t = (U*Az + V*Bz + W*Cz) / det;
+    return t > t_min && t < t_max;
+}
+
+class triangle_mesh: public hitable  {
+    public:
+        __device__ triangle_mesh() {}
+        __device__ triangle_mesh(const mesh_data& m, const bvh_node *n, material *mat) : mesh(m), nodes(n), mat_ptr(mat) {}
+        __device__ virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        __device__ virtual bool bounding_box(aabb& box) const { box = nodes[0].box; return true; }
+        mesh_data mesh;
+        const bvh_node *nodes;
+        material *mat_ptr;
+};
+
+struct triangle_mesh_leaf {
+    const mesh_data& mesh;
+    const watertight_ray& wr;
+    const ray& r;
+    material *mat_ptr;
+    __device__ bool operator()(int tri, float t_min, float t_max, hit_record& rec) const {
+        vec3 v0 = mesh_vertex(mesh, mesh.indices[3*tri]);
+        vec3 v1 = mesh_vertex(mesh, mesh.indices[3*tri+1]);
+        vec3 v2 = mesh_vertex(mesh, mesh.indices[3*tri+2]);
+        float t;
+        count_primitive_test(r);
+        if (!hit_triangle(wr, v0, v1, v2, t_min, t_max, t))
+            return false;
+        rec.t = t;
+        rec.p = r.point_at_parameter(t);
+        rec.normal = unit_vector(cross(v1 - v0, v2 - v0));
+        rec.mat_ptr = mat_ptr;
+        rec.prim_id = tri;
+        return true;
+    }
+};
+
+__device__ bool triangle_mesh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    watertight_ray wr = make_watertight_ray(r);
+    triangle_mesh_leaf leaf = { mesh, wr, r, mat_ptr };
+    return bvh_traverse(nodes, mesh.num_triangles, r, t_min, t_max, rec, leaf);
+}
+
+__global__ void mesh_triangle_boxes(mesh_data mesh, aabb *boxes) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= mesh.num_triangles) return;
+    vec3 v0 = mesh_vertex(mesh, mesh.indices[3*i]);
+    vec3 v1 = mesh_vertex(mesh, mesh.indices[3*i+1]);
+    vec3 v2 = mesh_vertex(mesh, mesh.indices[3*i+2]);
+    boxes[i] = surrounding_box(surrounding_box(aabb(v0, v0), aabb(v1, v1)), aabb(v2, v2));
+}
+
+// copies host SoA arrays to the device
+inline size_t mesh_bytes(int num_vertices, int num_triangles) {
+    return 3*size_t(num_vertices)*sizeof(float) + 3*size_t(num_triangles)*sizeof(int);
+}
+
+void mesh_upload(mesh_data& mesh, const float *vx, const float *vy, const float *vz, int num_vertices,
+                 const int *indices, int num_triangles) {
+    mesh.num_vertices = num_vertices;
+    mesh.num_triangles = num_triangles;
+    checkCudaErrors(cudaMalloc((void **)&mesh.vx, num_vertices*sizeof(float)));
+    checkCudaErrors(cudaMalloc((void **)&mesh.vy, num_vertices*sizeof(float)));
+    checkCudaErrors(cudaMalloc((void **)&mesh.vz, num_vertices*sizeof(float)));
+    checkCudaErrors(cudaMalloc((void **)&mesh.indices, 3*num_triangles*sizeof(int)));
+    checkCudaErrors(cudaMemcpy(mesh.vx, vx, num_vertices*sizeof(float), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(mesh.vy, vy, num_vertices*sizeof(float), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(mesh.vz, vz, num_vertices*sizeof(float), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(mesh.indices, indices, 3*num_triangles*sizeof(int), cudaMemcpyHostToDevice));
+    mem_alloc(MEM_SCENE, mesh_bytes(num_vertices, num_triangles));
+}
+
+void mesh_free(mesh_data& mesh) {
+    checkCudaErrors(cudaFree(mesh.vx));
+    checkCudaErrors(cudaFree(mesh.vy));
+    checkCudaErrors(cudaFree(mesh.vz));
+    checkCudaErrors(cudaFree(mesh.indices));
+    mem_release(MEM_SCENE, mesh_bytes(mesh.num_vertices, mesh.num_triangles));
+}
+
+// builds the mesh's LBVH over its triangles
+void mesh_build_bvh(const mesh_data& mesh, lbvh& bvh, bool morton64) {
+    lbvh_alloc(bvh, mesh.num_triangles, morton64);
+    mesh_triangle_boxes<<<(mesh.num_triangles+LBVH_BLOCK-1)/LBVH_BLOCK, LBVH_BLOCK>>>(mesh, bvh.boxes);
+    checkCudaErrors(cudaGetLastError());
+    lbvh_build(bvh);
+}
+
+#endif
@@ -5,12 +5,34 @@
 #include <stdlib.h>
 #include <iostream>
 
-class vec3  {
+// -DVEC3_SIMD pads vec3 to 16 aligned bytes, so the device moves it with
+// one 128-bit access and host code does the arithmetic with SSE.
+// -DVEC3_FAST_MATH computes lengths and normalizes through rsqrt, refined
+// by one Newton step on the host, instead of sqrt and a division.
+#if defined(VEC3_SIMD) && !defined(__CUDA_ARCH__) && defined(__SSE2__)
+#define VEC3_SSE
+#include <emmintrin.h>
+#endif
+
+#ifdef VEC3_SIMD
+#define VEC3_ALIGN __align__(16)
+#define VEC3_LANES 4
+#else
+#define VEC3_ALIGN
+#define VEC3_LANES 3
+#endif
+
+class VEC3_ALIGN vec3  {
 
 
 public:
     __host__ __device__ vec3() {}
-    __host__ __device__ vec3(float e0, float e1, float e2) { e[0] = e0; e[1] = e1; e[2] = e2; }
+    __host__ __device__ vec3(float e0, float e1, float e2) {
+        e[0] = e0; e[1] = e1; e[2] = e2;
+#ifdef VEC3_SIMD
+        e[3] = 0.0f;
+#endif
+    }
     __host__ __device__ inline float x() const { return e[0]; }
     __host__ __device__ inline float y() const { return e[1]; }
     __host__ __device__ inline float z() const { return e[2]; }
@@ -30,14 +52,41 @@ public:
     __host__ __device__ inline vec3& operator*=(const float t);
     __host__ __device__ inline vec3& operator/=(const float t);
 
-    __host__ __device__ inline float length() const { return sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]); }
+    __host__ __device__ inline float length() const;
     __host__ __device__ inline float squared_length() const { return e[0]*e[0] + e[1]*e[1] + e[2]*e[2]; }
     __host__ __device__ inline void make_unit_vector();
 
 
-    float e[3];
+    float e[VEC3_LANES];  // the fourth lane is padding and holds no value
 };
 
+#ifdef VEC3_SSE
+inline __m128 vec3_load(const vec3 &v) { return _mm_load_ps(v.e); }
+inline vec3 vec3_store(__m128 m) { vec3 v; _mm_store_ps(v.e, m); return v; }
+#endif
+
+// 1/sqrt(x); the device's rsqrtf is already within 2 ulp, the 12 bit SSE
+// estimate gets a Newton step
+__host__ __device__ inline float vec3_rsqrt(float x) {
+#if defined(__CUDA_ARCH__)
+    return rsqrtf(x);
+#elif defined(VEC3_SSE)
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - 0.5f*x*y*y);
+#else
+    return 1.0f / sqrtf(x);
+#endif
+}
+
+__host__ __device__ inline float vec3::length() const {
+#ifdef VEC3_FAST_MATH
+    float l2 = squared_length();
+    return l2 > 0.0f ? l2*vec3_rsqrt(l2) : 0.0f;
+#else
+    return sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+#endif
+}
+
 
 
 inline std::istream& operator>>(std::istream &is, vec3 &t) {
@@ -51,20 +100,42 @@ inline std::ostream& operator<<(std::ostream &os, const vec3 &t) {
 }
 
 __host__ __device__ inline void vec3::make_unit_vector() {
+#ifdef VEC3_FAST_MATH
+    float k = vec3_rsqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+#else
     float k = 1.0 / sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+#endif
     e[0] *= k; e[1] *= k; e[2] *= k;
 }
 
 __host__ __device__ inline vec3 operator+(const vec3 &v1, const vec3 &v2) {
+#ifdef VEC3_SSE
+    return vec3_store(_mm_add_ps(vec3_load(v1), vec3_load(v2)));
+#else
     return vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
+#endif
 }
 
 __host__ __device__ inline vec3 operator-(const vec3 &v1, const vec3 &v2) {
+#ifdef VEC3_SSE
+    return vec3_store(_mm_sub_ps(vec3_load(v1), vec3_load(v2)));
+#else
     return vec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]);
+#endif
 }
 
 __host__ __device__ inline vec3 operator*(const vec3 &v1, const vec3 &v2) {
+#ifdef VEC3_SSE
+    return vec3_store(_mm_mul_ps(vec3_load(v1), vec3_load(v2)));
+#else
     return vec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]);
+#endif
+}
+
+// v1*v2 rounded on its own, never fused into an add that follows, so that
+// sums of products come out the same wherever the compiler puts them
+__device__ inline vec3 mul_rn(const vec3 &v1, const vec3 &v2) {
+    return vec3(__fmul_rn(v1.e[0], v2.e[0]), __fmul_rn(v1.e[1], v2.e[1]), __fmul_rn(v1.e[2], v2.e[2]));
 }
 
 __host__ __device__ inline vec3 operator/(const vec3 &v1, const vec3 &v2) {
@@ -72,39 +143,72 @@ __host__ __device__ inline vec3 operator/(const vec3 &v1, const vec3 &v2) {
 }
 
 __host__ __device__ inline vec3 operator*(float t, const vec3 &v) {
+#ifdef VEC3_SSE
+    return vec3_store(_mm_mul_ps(_mm_set1_ps(t), vec3_load(v)));
+#else
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+#endif
 }
 
 __host__ __device__ inline vec3 operator/(vec3 v, float t) {
+#ifdef VEC3_SSE
+    return vec3_store(_mm_div_ps(vec3_load(v), _mm_set1_ps(t)));
+#else
     return vec3(v.e[0]/t, v.e[1]/t, v.e[2]/t);
+#endif
 }
 
 __host__ __device__ inline vec3 operator*(const vec3 &v, float t) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+    return t*v;
 }
 
 __host__ __device__ inline float dot(const vec3 &v1, const vec3 &v2) {
+#ifdef VEC3_SSE
+    // sums lanes 0-2 only, the padding lane may hold anything
+    __m128 m = _mm_mul_ps(vec3_load(v1), vec3_load(v2));
+    __m128 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(m, y), z));
+#else
     return v1.e[0] *v2.e[0] + v1.e[1] *v2.e[1]  + v1.e[2] *v2.e[2];
+#endif
 }
 
 __host__ __device__ inline vec3 cross(const vec3 &v1, const vec3 &v2) {
+#ifdef VEC3_SSE
+    // (a.yzx * b.zxy) - (a.zxy * b.yzx)
+    __m128 a = vec3_load(v1), b = vec3_load(v2);
+    __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+    return vec3_store(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+#else
     return vec3( (v1.e[1]*v2.e[2] - v1.e[2]*v2.e[1]),
                 (-(v1.e[0]*v2.e[2] - v1.e[2]*v2.e[0])),
                 (v1.e[0]*v2.e[1] - v1.e[1]*v2.e[0]));
+#endif
 }
 
 
 __host__ __device__ inline vec3& vec3::operator+=(const vec3 &v){
+#ifdef VEC3_SSE
+    *this = *this + v;
+#else
     e[0]  += v.e[0];
     e[1]  += v.e[1];
     e[2]  += v.e[2];
+#endif
     return *this;
 }
 
 __host__ __device__ inline vec3& vec3::operator*=(const vec3 &v){
+#ifdef VEC3_SSE
+    *this = *this * v;
+#else
     e[0]  *= v.e[0];
     e[1]  *= v.e[1];
     e[2]  *= v.e[2];
+#endif
     return *this;
 }
 
@@ -116,16 +220,24 @@ __host__ __device__ inline vec3& vec3::operator/=(const vec3 &v){
 }
 
 __host__ __device__ inline vec3& vec3::operator-=(const vec3& v) {
+#ifdef VEC3_SSE
+    *this = *this - v;
+#else
     e[0]  -= v.e[0];
     e[1]  -= v.e[1];
     e[2]  -= v.e[2];
+#endif
     return *this;
 }
 
 __host__ __device__ inline vec3& vec3::operator*=(const float t) {
+#ifdef VEC3_SSE
+    *this = t * *this;
+#else
     e[0]  *= t;
     e[1]  *= t;
     e[2]  *= t;
+#endif
     return *this;
 }
 
@@ -139,7 +251,11 @@ __host__ __device__ inline vec3& vec3::operator/=(const float t) {
 }
 
 __host__ __device__ inline vec3 unit_vector(vec3 v) {
+#ifdef VEC3_FAST_MATH
+    return v * vec3_rsqrt(v.squared_length());
+#else
     return v / v.length();
+#endif
 }
 
 #endif
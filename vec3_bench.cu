@@ -0,0 +1,105 @@
+// Host microbenchmark of the vector math on the render's hot path: sphere
+// intersection, reflect and refract over batches of random inputs.  The
+// Makefile builds it three times, as vec3_bench with the plain vec3,
+// vec3_bench_simd with -DVEC3_SIMD and vec3_bench_fast with -DVEC3_SIMD
+// -DVEC3_FAST_MATH, so `make bench_vec3` compares the representations.
+// Where the kernel allows it each line is followed by the hardware
+// counters of its runs (perf_counters.h).
+#include <float.h>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include <curand_kernel.h>
+#include "vec3.h"
+#include "ray.h"
+#include "sphere.h"
+#include "material.h"
+#include "perf_counters.h"
+
+#define BENCH_COUNT (1 << 20)
+#define BENCH_REPS 10
+
+// best of BENCH_REPS runs of f over the whole batch, in ns per element,
+// pc counts all of them
+template <typename F>
+double time_batch(F f, perf_counters& pc) {
+    perf_open(pc);
+    double best = DBL_MAX;
+    for (int rep = 0; rep < BENCH_REPS; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        perf_start(pc);
+        f();
+        perf_stop(pc);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        best = ns < best ? ns : best;
+    }
+    perf_close(pc);
+    return best / BENCH_COUNT;
+}
+
+int main() {
+    std::mt19937 rng(1984);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    std::vector<ray> rays(BENCH_COUNT);
+    std::vector<vec3> centers(BENCH_COUNT), normals(BENCH_COUNT);
+    std::vector<float> radii(BENCH_COUNT);
+    for (int i = 0; i < BENCH_COUNT; i++) {
+        vec3 origin(5.0f*uniform(rng), 5.0f*uniform(rng), 5.0f*uniform(rng));
+        vec3 dir = unit_vector(vec3(uniform(rng), uniform(rng), uniform(rng)));
+        rays[i] = ray(origin, dir);
+        centers[i] = vec3(5.0f*uniform(rng), 5.0f*uniform(rng), 5.0f*uniform(rng));
+        radii[i] = 1.25f + uniform(rng);
+        normals[i] = unit_vector(vec3(uniform(rng), uniform(rng), uniform(rng)));
+    }
+
+    // the sums keep the compiler from dropping the loops
+    perf_counters hit_pc, reflect_pc, refract_pc, unit_pc;
+    int hits = 0;
+    double hit_ns = time_batch([&]() {
+        hits = 0;
+        for (int i = 0; i < BENCH_COUNT; i++) {
+            float t;
+            hits += hit_sphere(centers[i], radii[i], rays[i], 0.001f, FLT_MAX, t);
+        }
+    }, hit_pc);
+    vec3 reflected_sum;
+    double reflect_ns = time_batch([&]() {
+        reflected_sum = vec3(0, 0, 0);
+        for (int i = 0; i < BENCH_COUNT; i++)
+            reflected_sum += reflect(rays[i].direction(), normals[i]);
+    }, reflect_pc);
+    vec3 refracted_sum;
+    double refract_ns = time_batch([&]() {
+        refracted_sum = vec3(0, 0, 0);
+        for (int i = 0; i < BENCH_COUNT; i++) {
+            vec3 refracted;
+            if (refract(rays[i].direction(), normals[i], 1.0f/1.5f, refracted))
+                refracted_sum += refracted;
+        }
+    }, refract_pc);
+    double unit_ns = time_batch([&]() {
+        refracted_sum = vec3(0, 0, 0);
+        for (int i = 0; i < BENCH_COUNT; i++)
+            refracted_sum += unit_vector(centers[i]);
+    }, unit_pc);
+
+#ifdef VEC3_SSE
+    std::cout << "vec3: SSE, " << sizeof(vec3) << " bytes";
+#else
+    std::cout << "vec3: scalar, " << sizeof(vec3) << " bytes";
+#endif
+#ifdef VEC3_FAST_MATH
+    std::cout << ", rsqrt normalization";
+#endif
+    std::cout << "\n";
+    const double items = double(BENCH_COUNT)*BENCH_REPS;
+    std::cout << "sphere hit:  " << hit_ns << " ns (" << hits << " hits)\n";
+    perf_report(std::cout, hit_pc, "  counters", items, "ray");
+    std::cout << "reflect:     " << reflect_ns << " ns (sum " << reflected_sum << ")\n";
+    perf_report(std::cout, reflect_pc, "  counters", items, "ray");
+    std::cout << "refract:     " << refract_ns << " ns\n";
+    perf_report(std::cout, refract_pc, "  counters", items, "ray");
+    std::cout << "unit_vector: " << unit_ns << " ns (sum " << refracted_sum << ")\n";
+    perf_report(std::cout, unit_pc, "  counters", items, "vector");
+}
@@ -0,0 +1,180 @@
+#ifndef WAVEFRONTH
+#define WAVEFRONTH
+
+#include <float.h>
+#include <curand_kernel.h>
+#include <thrust/device_ptr.h>
+#include <thrust/remove.h>
+#include <thrust/sort.h>
+#include "check_cuda.h"
+#include "camera.h"
+#include "material.h"
+#include "lbvh.h"
+#include "framebuffer.h"
+
+// Wavefront version of render(): instead of one thread following a path
+// through all its bounces, every bounce of every path in flight is one
+// kernel launch over a compacted list of live paths.  Between bounces the
+// list can be sorted by a key made of the ray's direction octant and the
+// Morton code of its origin, so that neighbouring threads trace rays that
+// start close together and head the same way and therefore walk the same
+// BVH nodes.  Camera rays are coherent already, so sorting starts after the
+// first scatter.  Paths live in per-pixel slots: sorting only permutes the
+// list of slot indices and results are written back to the slots.
+//
+// Each path draws the random numbers of its pixel and sample (see
+// sample_rng.h) in the order color() does, so the image matches the
+// megakernel's.
+
+#define WAVEFRONT_BLOCK 128
+
+struct wavefront_paths {
+    ray *rays;
+    vec3 *throughput;
+    vec3 *accum;
+    int *alive;
+    int *active;                 // slot indices of the live paths, in trace order
+    unsigned long long *keys;
+    sample_rng *rng;             // of the sample each path traces
+};
+
+// per pixel; sorting rays has thrust take about as much again for the keys
+// and slots while it runs, which is not counted
+inline size_t wavefront_bytes(int num_pixels) {
+    return num_pixels*(sizeof(ray) + 2*sizeof(vec3) + 2*sizeof(int) + sizeof(unsigned long long) + sizeof(sample_rng));
+}
+
+// starts the paths of the given sample, drawing what render_pixel() does
+__global__ void wavefront_generate(wavefront_paths p, int max_x, int max_y, camera **cam, unsigned int seed, int sample) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    int j = threadIdx.y + blockIdx.y * blockDim.y;
+    if((i >= max_x) || (j >= max_y)) return;
+    int pixel_index = j*max_x + i;
+    sample_rng local_rand_state;
+    sample_rng_init(&local_rand_state, seed, pixel_index, sample);
+    float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
+    float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
+    p.rays[pixel_index] = (*cam)->get_ray(u, v, &local_rand_state);
+    p.throughput[pixel_index] = vec3(1.0, 1.0, 1.0);
+    p.alive[pixel_index] = 1;
+    p.active[pixel_index] = pixel_index;
+    p.rng[pixel_index] = local_rand_state;
+}
+
+// one bounce of the loop in color()
+__global__ void wavefront_extend(wavefront_paths p, int num_active, bool last_bounce, hitable **world) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    if (k >= num_active) return;
+    int idx = p.active[k];
+    ray cur_ray = p.rays[idx];
+    hit_record rec;
+    if ((*world)->hit(cur_ray, 0.001f, FLT_MAX, rec)) {
+        sample_rng local_rand_state = p.rng[idx];
+        ray scattered;
+        vec3 attenuation;
+        if (rec.mat_ptr->scatter(cur_ray, rec, attenuation, scattered, &local_rand_state) && !last_bounce) {
+            p.throughput[idx] *= attenuation;
+            p.rays[idx] = scattered;
+        }
+        else {
+            p.alive[idx] = 0;
+        }
+        p.rng[idx] = local_rand_state;
+    }
+    else {
+        // rounded like render_pixel()'s sum of color(), see mul_rn()
+        p.accum[idx] += mul_rn(p.throughput[idx], sky_color(cur_ray));
+        p.alive[idx] = 0;
+    }
+}
+
+__global__ void wavefront_sort_keys(wavefront_paths p, int num_active, aabb bounds) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    if (k >= num_active) return;
+    int idx = p.active[k];
+    vec3 dir = p.rays[idx].direction();
+    unsigned long long octant = (dir.x() < 0.0f ? 1 : 0) | (dir.y() < 0.0f ? 2 : 0) | (dir.z() < 0.0f ? 4 : 0);
+    vec3 extent = bounds.max() - bounds.min();
+    vec3 o = p.rays[idx].origin() - bounds.min();
+    vec3 q(o.x() / extent.x(), o.y() / extent.y(), o.z() / extent.z());
+    p.keys[k] = (octant << 30) | morton_code<unsigned int>(q);
+}
+
+__global__ void wavefront_finish(framebuffer fb, wavefront_paths p, int num_pixels, int ns) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= num_pixels) return;
+    fb_add_samples(fb, i, p.accum[i], ns);
+}
+
+__global__ void wavefront_world_bounds(hitable **world, aabb *bounds) {
+    if (!(*world)->bounding_box(*bounds))
+        *bounds = aabb(vec3(-1000, -1000, -1000), vec3(1000, 1000, 1000));
+}
+
+struct wavefront_path_done {
+    const int *alive;
+    __host__ __device__ bool operator()(int idx) const { return !alive[idx]; }
+};
+
+// renders samples first_sample to first_sample+ns-1, like launch_render()
+void render_wavefront(const framebuffer& fb, int nx, int ny, int ns, int max_depth, int tx, int ty, camera **cam, hitable **world,
+                      unsigned int seed, int first_sample, bool sort_rays, unsigned long long *ray_count) {
+    int num_pixels = nx*ny;
+    wavefront_paths p;
+    checkCudaErrors(cudaMalloc((void **)&p.rays, num_pixels*sizeof(ray)));
+    checkCudaErrors(cudaMalloc((void **)&p.throughput, num_pixels*sizeof(vec3)));
+    checkCudaErrors(cudaMalloc((void **)&p.accum, num_pixels*sizeof(vec3)));
+    checkCudaErrors(cudaMalloc((void **)&p.alive, num_pixels*sizeof(int)));
+    checkCudaErrors(cudaMalloc((void **)&p.active, num_pixels*sizeof(int)));
+    checkCudaErrors(cudaMalloc((void **)&p.keys, num_pixels*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMalloc((void **)&p.rng, num_pixels*sizeof(sample_rng)));
+    checkCudaErrors(cudaMemset(p.accum, 0, num_pixels*sizeof(vec3)));
+    mem_alloc(MEM_SCRATCH, wavefront_bytes(num_pixels));
+
+    aabb *d_bounds;
+    aabb bounds;
+    checkCudaErrors(cudaMalloc((void **)&d_bounds, sizeof(aabb)));
+    wavefront_world_bounds<<<1,1>>>(world, d_bounds);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaMemcpy(&bounds, d_bounds, sizeof(aabb), cudaMemcpyDeviceToHost));
+    checkCudaErrors(cudaFree(d_bounds));
+
+    dim3 blocks(nx/tx+1,ny/ty+1);
+    dim3 threads(tx,ty);
+    thrust::device_ptr<int> active(p.active);
+    unsigned long long rays = 0;
+    for (int s = 0; s < ns; s++) {
+        wavefront_generate<<<blocks, threads>>>(p, nx, ny, cam, seed, first_sample + s);
+        checkCudaErrors(cudaGetLastError());
+        int num_active = num_pixels;
+        for (int bounce = 0; bounce < max_depth && num_active > 0; bounce++) {
+            int wf_blocks = (num_active + WAVEFRONT_BLOCK-1) / WAVEFRONT_BLOCK;
+            if (sort_rays && bounce > 0) {
+                wavefront_sort_keys<<<wf_blocks, WAVEFRONT_BLOCK>>>(p, num_active, bounds);
+                checkCudaErrors(cudaGetLastError());
+                thrust::sort_by_key(thrust::device_ptr<unsigned long long>(p.keys),
+                                    thrust::device_ptr<unsigned long long>(p.keys + num_active), active);
+            }
+            wavefront_extend<<<wf_blocks, WAVEFRONT_BLOCK>>>(p, num_active, bounce == max_depth-1, world);
+            checkCudaErrors(cudaGetLastError());
+            rays += num_active;
+            wavefront_path_done done = { p.alive };
+            num_active = int(thrust::remove_if(active, active + num_active, done) - active);
+        }
+    }
+    wavefront_finish<<<(num_pixels+WAVEFRONT_BLOCK-1)/WAVEFRONT_BLOCK, WAVEFRONT_BLOCK>>>(fb, p, num_pixels, ns);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    *ray_count += rays;
+
+    checkCudaErrors(cudaFree(p.rays));
+    checkCudaErrors(cudaFree(p.throughput));
+    checkCudaErrors(cudaFree(p.accum));
+    checkCudaErrors(cudaFree(p.alive));
+    checkCudaErrors(cudaFree(p.active));
+    checkCudaErrors(cudaFree(p.keys));
+    checkCudaErrors(cudaFree(p.rng));
+    mem_release(MEM_SCRATCH, wavefront_bytes(num_pixels));
+}
+
+#endif